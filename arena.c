@@ -0,0 +1,149 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/* the strictest alignment needed by anything allocated from an arena */
+union arena__alignment
+{
+  long long l;
+  double d;
+  void *p;
+};
+
+#define ARENA_ALIGNMENT sizeof(union arena__alignment)
+
+/* blocks start with their link, padded to keep allocations aligned */
+#define ARENA_HEADER_SIZE ((sizeof(struct arenablock) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT)
+
+void arena_init(struct arena *arena)
+{
+  arena->blocks = 0;
+  arena->free = 0;
+  arena->remaining = 0;
+#ifndef NO_THREADS
+  pthread_mutex_init(&arena->mutex, 0);
+#endif
+}
+
+/* Allocate size bytes with the given alignment, which must be a power
+   of two. Returns 0 if out of memory. */
+static void *arena__allocate(struct arena *arena, size_t size, size_t alignment)
+{
+  struct arenablock *block;
+  size_t padding;
+  size_t blocksize;
+  void *result;
+
+#ifndef NO_THREADS
+  pthread_mutex_lock(&arena->mutex);
+#endif
+
+  padding = (alignment - ((size_t) arena->free & (alignment - 1))) & (alignment - 1);
+
+  if (arena->free == 0 || padding + size > arena->remaining)
+  {
+    blocksize = ARENA_HEADER_SIZE + size > ARENA_BLOCK_SIZE ? ARENA_HEADER_SIZE + size : ARENA_BLOCK_SIZE;
+
+    block = (struct arenablock*) malloc(blocksize);
+    if (block == 0)
+    {
+#ifndef NO_THREADS
+      pthread_mutex_unlock(&arena->mutex);
+#endif
+      return 0;
+    }
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->free = (char*) block + ARENA_HEADER_SIZE;
+    arena->remaining = blocksize - ARENA_HEADER_SIZE;
+    padding = 0;
+  }
+
+  result = arena->free + padding;
+  arena->free += padding + size;
+  arena->remaining -= padding + size;
+
+#ifndef NO_THREADS
+  pthread_mutex_unlock(&arena->mutex);
+#endif
+
+  return result;
+}
+
+/* Allocate memory suitably aligned for any object fdupes stores. */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+  return arena__allocate(arena, size, ARENA_ALIGNMENT);
+}
+
+/* Copy a string into the arena, packed with no alignment padding. */
+char *arena_strdup(struct arena *arena, const char *s)
+{
+  size_t length = strlen(s) + 1;
+  char *copy;
+
+  copy = (char*) arena__allocate(arena, length, 1);
+  if (copy != 0)
+    memcpy(copy, s, length);
+
+  return copy;
+}
+
+/* Copy the concatenation of two strings into the arena. */
+char *arena_strjoin(struct arena *arena, const char *a, const char *b)
+{
+  size_t alength = strlen(a);
+  size_t blength = strlen(b) + 1;
+  char *copy;
+
+  copy = (char*) arena__allocate(arena, alength + blength, 1);
+  if (copy != 0)
+  {
+    memcpy(copy, a, alength);
+    memcpy(copy + alength, b, blength);
+  }
+
+  return copy;
+}
+
+/* Release everything allocated from the arena. */
+void arena_free(struct arena *arena)
+{
+  struct arenablock *block;
+
+  while (arena->blocks != 0)
+  {
+    block = arena->blocks;
+    arena->blocks = block->next;
+    free(block);
+  }
+
+  arena->free = 0;
+  arena->remaining = 0;
+#ifndef NO_THREADS
+  pthread_mutex_destroy(&arena->mutex);
+#endif
+}
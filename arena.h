@@ -0,0 +1,57 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#ifndef NO_THREADS
+  #include <pthread.h>
+#endif
+
+/* size of each block of memory an arena hands out allocations from */
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+struct arenablock
+{
+  struct arenablock *next;
+};
+
+/* Memory for many small, long-lived allocations, carved out of large
+   blocks and released all at once. Safe to use from several threads
+   at once. */
+struct arena
+{
+  struct arenablock *blocks;
+  char *free;
+  size_t remaining;
+#ifndef NO_THREADS
+  pthread_mutex_t mutex;
+#endif
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *s);
+char *arena_strjoin(struct arena *arena, const char *a, const char *b);
+void arena_free(struct arena *arena);
+
+#endif
@@ -0,0 +1,153 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+/* Time confirmmatch() against the stdio and memcmp() comparison it
+   replaced, on two files given on the command line, with their pages
+   cached and, where the kernel lets them be dropped, uncached.
+
+   Build with "make bench/confirmbench" and run as
+   bench/confirmbench FILE1 FILE2 [ROUNDS]. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "fdupes.h"
+#include "confirmmatch.h"
+
+char *program_name = "confirmbench";
+iotype_t iomode = IO_STDIO;
+
+/* confirmmatch() as it was before reading in large windows */
+static int stdiomatch(FILE *file1, FILE *file2)
+{
+  unsigned char c1[CHUNK_SIZE];
+  unsigned char c2[CHUNK_SIZE];
+  size_t r1;
+  size_t r2;
+
+  fseek(file1, 0, SEEK_SET);
+  fseek(file2, 0, SEEK_SET);
+
+  do {
+    r1 = fread(c1, sizeof(unsigned char), sizeof(c1), file1);
+    r2 = fread(c2, sizeof(unsigned char), sizeof(c2), file2);
+
+    if (r1 != r2) return 0;
+    if (memcmp(c1, c2, r1)) return 0;
+  } while (r2);
+
+  return 1;
+}
+
+/* Ask the kernel to drop a file's cached pages; clean pages are dropped
+   without needing root, so this stands in for drop_caches. */
+static void uncache(const char *path)
+{
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static double run(int (*match)(FILE*, FILE*), const char *path1, const char *path2, int cold, int *result)
+{
+  struct timespec start;
+  struct timespec end;
+  FILE *file1;
+  FILE *file2;
+
+  if (cold) {
+    uncache(path1);
+    uncache(path2);
+  }
+
+  file1 = fopen(path1, "rb");
+  file2 = fopen(path2, "rb");
+  if (file1 == 0 || file2 == 0) {
+    perror("fopen");
+    exit(1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  *result = match(file1, file2);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fclose(file1);
+  fclose(file2);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  static const char *names[] = { "stdio+memcmp", "confirmmatch" };
+  int (*matches[2])(FILE*, FILE*) = { stdiomatch, confirmmatch };
+  double best;
+  double worst;
+  double seconds;
+  int rounds;
+  int result;
+  int cold;
+  int m;
+  int r;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s FILE1 FILE2 [ROUNDS]\n", argv[0]);
+    return 2;
+  }
+
+  rounds = argc > 3 ? atoi(argv[3]) : 5;
+  if (rounds < 1)
+    rounds = 1;
+
+  for (cold = 0; cold <= 1; ++cold) {
+    /* warm the page cache before timing cached reads */
+    if (!cold)
+      run(stdiomatch, argv[1], argv[2], 0, &result);
+
+    for (m = 0; m < 2; ++m) {
+      best = worst = 0;
+
+      for (r = 0; r < rounds; ++r) {
+        seconds = run(matches[m], argv[1], argv[2], cold, &result);
+
+        if (r == 0 || seconds < best)
+          best = seconds;
+        if (r == 0 || seconds > worst)
+          worst = seconds;
+      }
+
+      printf("%-8s %-14s %s  %.3f-%.3f s\n", cold ? "uncached" : "cached", names[m],
+        result ? "same" : "different", best, worst);
+    }
+  }
+
+  return 0;
+}
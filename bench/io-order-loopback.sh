@@ -0,0 +1,82 @@
+#!/bin/sh
+# Compare --io-order=none, inode and physical on a loopback ext4 image
+# whose files are written interleaved, so that each file is split into
+# many extents scattered between the others', and whose directory order
+# has nothing to do with where the files lie.
+#
+# Needs root (for the loop mount and dropping caches). Usage:
+#   bench/io-order-loopback.sh [FDUPES] [FILES] [SIZE_KB] [ROUNDS]
+# Set IMAGE_DIR to place the image somewhere other than /tmp, such as on
+# the rotational disk to be measured. Files are SIZE_KB rounded down to
+# a multiple of 64 KiB.
+
+FDUPES=${1:-./fdupes}
+FILES=${2:-400}
+SIZE_KB=${3:-1024}
+ROUNDS=${4:-3}
+
+FDUPES=`cd "\`dirname "$FDUPES"\`" && pwd`/`basename "$FDUPES"`
+
+if [ "$SIZE_KB" -lt 64 ]; then
+  echo "$0: SIZE_KB must be at least 64" >&2
+  exit 1
+fi
+
+if [ "`id -u`" != 0 ]; then
+  echo "$0: must be run as root" >&2
+  exit 1
+fi
+
+work=`mktemp -d "${IMAGE_DIR:-/tmp}/io-order.XXXXXX"` || exit 1
+image="$work/image"
+mnt="$work/mnt"
+
+cleanup() {
+  umount "$mnt" 2>/dev/null
+  rm -rf "$work"
+}
+trap cleanup EXIT
+
+# room for every file twice over, plus file system overhead
+image_mb=`expr $FILES \* $SIZE_KB \* 2 / 1024 + 64`
+dd if=/dev/zero of="$image" bs=1M count=0 seek=$image_mb 2>/dev/null || exit 1
+mkfs.ext4 -q -F -O ^flex_bg "$image" || exit 1
+mkdir "$mnt"
+mount -o loop "$image" "$mnt" || exit 1
+
+# files come in pairs of identical files holding random data of their
+# own, so every file is hashed and confirmed against just one other; each
+# round of 64 KiB goes to every file in turn, synced so that the
+# allocator cannot keep any file contiguous
+mkdir "$mnt/files"
+chunks=`expr $SIZE_KB / 64`
+chunk=0
+while [ $chunk -lt $chunks ]; do
+  i=0
+  while [ $i -lt $FILES ]; do
+    # files are named in an order unrelated to their creation order
+    name=`printf '%08x' \`expr \( $i \* 7919 \) % 1000003\``
+    head -c 65536 /dev/urandom > "$work/chunk"
+    cat "$work/chunk" >> "$mnt/files/$name"
+    cat "$work/chunk" >> "$mnt/files/$name.copy"
+    i=`expr $i + 2`
+  done
+  sync
+  chunk=`expr $chunk + 1`
+done
+
+first=`ls "$mnt/files" | head -n 1`
+echo "extents in $first: `filefrag "$mnt/files/$first" | sed 's/.*: //'`"
+
+for order in none inode physical; do
+  round=0
+  while [ $round -lt $ROUNDS ]; do
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    start=`date +%s.%N`
+    "$FDUPES" -r -q --io-order=$order "$mnt/files" > /dev/null || exit 1
+    end=`date +%s.%N`
+    echo "$start $end" | awk -v order=$order '{ printf "%-8s %.2f s\n", order ":", $2 - $1 }'
+    round=`expr $round + 1`
+  done
+done
@@ -22,22 +22,119 @@
 #include "config.h"
 #include "sigint.h"
 #include "confirmmatch.h"
+#include "errormsg.h"
+#include "fdupes.h"
+#include "stats.h"
+#ifdef HAVE_MMAP_IO
+  #include "mmapio.h"
+  #include <sys/stat.h>
+#endif
 #include <stdlib.h>
 #include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Read up to size bytes, retrying short reads so that both files are
+   always compared in windows of the same length. Returns -1 on error. */
+static ssize_t readwindow(int fd, unsigned char *buffer, size_t size)
+{
+  size_t total = 0;
+  ssize_t r;
+
+  while (total < size) {
+    r = read(fd, buffer + total, size - total);
+    if (r == 0)
+      break;
+
+    if (r < 0) {
+      if (errno == EINTR && !got_sigint)
+        continue;
+      return -1;
+    }
+
+    total += r;
+  }
+
+  return total;
+}
+
+/* Ask the kernel to start reading the window that follows offset. */
+static void readahead_next(int fd, off_t offset)
+{
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, offset, CONFIRM_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+#endif
+}
+
+static unsigned char *allocatewindow()
+{
+  void *buffer;
+
+#ifdef HAVE_POSIX_MEMALIGN
+  if (posix_memalign(&buffer, 4096, CONFIRM_BUFFER_SIZE) != 0)
+    buffer = 0;
+#else
+  buffer = malloc(CONFIRM_BUFFER_SIZE);
+#endif
+
+  if (buffer == 0) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  return (unsigned char *) buffer;
+}
 
 /* Do a bit-for-bit comparison in case two different files produce the
-   same signature. Unlikely, but better safe than sorry. */
+   same signature. Unlikely, but better safe than sorry.
+
+   Files are read directly from their descriptors in large windows, with
+   readahead requested for the window that follows, and compared using
+   memcmp(), which the C library already dispatches to the widest
+   vector instructions the CPU supports. With --io=mmap, files are
+   compared straight from the page cache instead, falling back to
+   reading them if they cannot be mapped. The streams' positions are
+   unspecified afterward. */
 
 int confirmmatch(FILE *file1, FILE *file2)
 {
-  unsigned char c1[CHUNK_SIZE];
-  unsigned char c2[CHUNK_SIZE];
-  size_t r1;
-  size_t r2;
+  static unsigned char *c1 = 0;
+  static unsigned char *c2 = 0;
+  int fd1;
+  int fd2;
+  ssize_t r1;
+  ssize_t r2;
+  off_t offset = 0;
+#ifdef HAVE_MMAP_IO
+  int result;
+
+  if (iomode == IO_MMAP) {
+    result = mmapio_compare(fileno(file1), fileno(file2));
+    if (result >= 0)
+      return result;
+  }
+#endif
+
+  if (c1 == 0) {
+    c1 = allocatewindow();
+    c2 = allocatewindow();
+  }
 
   fseek(file1, 0, SEEK_SET);
   fseek(file2, 0, SEEK_SET);
 
+  fd1 = fileno(file1);
+  fd2 = fileno(file2);
+
+  lseek(fd1, 0, SEEK_SET);
+  lseek(fd2, 0, SEEK_SET);
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd2, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
   do {
     if (got_sigint) {
       fclose(file1);
@@ -45,12 +142,380 @@ int confirmmatch(FILE *file1, FILE *file2)
       exit(0);
     }
 
-    r1 = fread(c1, sizeof(unsigned char), sizeof(c1), file1);
-    r2 = fread(c2, sizeof(unsigned char), sizeof(c2), file2);
+    r1 = readwindow(fd1, c1, CONFIRM_BUFFER_SIZE);
+    r2 = readwindow(fd2, c2, CONFIRM_BUFFER_SIZE);
+
+    if (r1 < 0 || r2 < 0) return 0; /* read error */
+
+    stats_add(&stats.comparebytes, r1 + r2);
 
     if (r1 != r2) return 0; /* file lengths are different */
+
+    offset += r1;
+
+    if (r1 == CONFIRM_BUFFER_SIZE) {
+      readahead_next(fd1, offset);
+      readahead_next(fd2, offset);
+    }
+
     if (memcmp (c1, c2, r1)) return 0; /* file contents are different */
   } while (r2);
 
   return 1;
 }
+
+#ifdef HAVE_MMAP_IO
+/* With --io=mmap, map the window of a file of the given size that
+   starts at offset instead of reading it. Returns the window's length,
+   or -1 if it cannot be mapped. */
+static ssize_t mapwindow(int fd, off_t offset, off_t size, unsigned char **map)
+{
+  size_t length;
+
+  *map = 0;
+
+  if (offset >= size)
+    return 0;
+
+  length = size - offset > CONFIRM_BUFFER_SIZE ? CONFIRM_BUFFER_SIZE : size - offset;
+
+  *map = mmapio_map(fd, offset, length);
+
+  return *map != 0 ? (ssize_t) length : -1;
+}
+#endif
+
+/* Compare two windows, which may be mapped. */
+static int windowsequal(const unsigned char *window1, const unsigned char *window2, size_t length)
+{
+#ifdef HAVE_MMAP_IO
+  if (iomode == IO_MMAP)
+    return mmapio_equal(window1, window2, length);
+#endif
+
+  return memcmp(window1, window2, length) == 0;
+}
+
+/* Read one batch of open files in lockstep, in CONFIRM_BUFFER_SIZE
+   windows with readahead requested for the window that follows, or
+   mapped straight from the page cache with --io=mmap. On return,
+   labels[f] is the index of the first file in the batch with the same
+   contents as file f, or -1 if f is not open or cannot be read. Each
+   file stops being read as soon as no other file shares its contents. */
+static void confirmgroup__batch(int *fds, size_t count, int *labels, unsigned char **buffers)
+{
+  ssize_t *lengths;
+  unsigned char **windows;
+  int *previous;
+  char *active;
+  off_t offset;
+  size_t remaining;
+  size_t i;
+  size_t j;
+#ifdef HAVE_MMAP_IO
+  struct stat info;
+  unsigned char **maps;
+  off_t *sizes;
+#endif
+
+  lengths = (ssize_t*) malloc(sizeof(ssize_t) * count);
+  windows = (unsigned char**) malloc(sizeof(unsigned char*) * count);
+  previous = (int*) malloc(sizeof(int) * count);
+  active = (char*) malloc(count);
+  if (lengths == 0 || windows == 0 || previous == 0 || active == 0) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+#ifdef HAVE_MMAP_IO
+  maps = (unsigned char**) malloc(sizeof(unsigned char*) * count);
+  sizes = (off_t*) malloc(sizeof(off_t) * count);
+  if (maps == 0 || sizes == 0) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+#endif
+
+  remaining = 0;
+  for (i = 0; i < count; ++i) {
+    labels[i] = fds[i] < 0 ? -1 : 0;
+    active[i] = fds[i] >= 0;
+    if (active[i])
+      ++remaining;
+
+#ifdef HAVE_MMAP_IO
+    /* a size of -1 means the file is read rather than mapped */
+    maps[i] = 0;
+    sizes[i] = -1;
+    if (active[i] && iomode == IO_MMAP && fstat(fds[i], &info) == 0)
+      sizes[i] = info.st_size;
+#endif
+  }
+
+  offset = 0;
+
+  while (remaining > 1) {
+    if (got_sigint)
+      exit(0);
+
+    for (i = 0; i < count; ++i) {
+      if (!active[i])
+        continue;
+
+      windows[i] = buffers[i];
+
+#ifdef HAVE_MMAP_IO
+      if (sizes[i] >= 0) {
+        lengths[i] = mapwindow(fds[i], offset, sizes[i], &maps[i]);
+        if (lengths[i] >= 0) {
+          if (maps[i] != 0)
+            windows[i] = maps[i];
+
+          stats_add(&stats.comparebytes, lengths[i]);
+          continue;
+        }
+
+        /* read this file from here on */
+        sizes[i] = -1;
+        lseek(fds[i], offset, SEEK_SET);
+      }
+#endif
+
+      lengths[i] = readwindow(fds[i], buffers[i], CONFIRM_BUFFER_SIZE);
+      if (lengths[i] < 0) {
+        labels[i] = -1;
+        active[i] = 0;
+        --remaining;
+        continue;
+      }
+
+      if (lengths[i] == CONFIRM_BUFFER_SIZE)
+        readahead_next(fds[i], offset + CONFIRM_BUFFER_SIZE);
+
+      stats_add(&stats.comparebytes, lengths[i]);
+    }
+
+    offset += CONFIRM_BUFFER_SIZE;
+
+    /* split each set whose members read different data */
+    for (i = 0; i < count; ++i)
+      previous[i] = labels[i];
+
+    for (i = 0; i < count; ++i) {
+      if (!active[i])
+        continue;
+
+      labels[i] = i;
+
+      for (j = 0; j < i; ++j) {
+        if (active[j] && labels[j] == (int) j && previous[j] == previous[i] &&
+            lengths[j] == lengths[i] && windowsequal(windows[j], windows[i], lengths[i]))
+        {
+          labels[i] = j;
+          break;
+        }
+      }
+    }
+
+#ifdef HAVE_MMAP_IO
+    for (i = 0; i < count; ++i) {
+      if (maps[i] != 0) {
+        mmapio_unmap(maps[i], lengths[i]);
+        maps[i] = 0;
+      }
+    }
+#endif
+
+    /* files that reached their end, or no longer match any other file,
+       need not be read any further */
+    for (i = 0; i < count; ++i) {
+      if (!active[i])
+        continue;
+
+      if (lengths[i] < CONFIRM_BUFFER_SIZE) {
+        active[i] = 0;
+        --remaining;
+        continue;
+      }
+
+      for (j = 0; j < count; ++j)
+        if (j != i && active[j] && labels[j] == labels[i])
+          break;
+
+      if (j == count) {
+        active[i] = 0;
+        --remaining;
+      }
+    }
+  }
+
+  free(lengths);
+  free(windows);
+  free(previous);
+  free(active);
+#ifdef HAVE_MMAP_IO
+  free(maps);
+  free(sizes);
+#endif
+}
+
+/* Compare the first files of sets first to last - 1, found in the
+   latest batch, against those of the sets found in earlier batches
+   (1 to first - 1), in batches of up to GROUP_MAX_FILES files. On
+   return, same[l] is the earlier set with the same contents as set l,
+   or -1 if there is none. Files first found in the same batch are
+   already known to differ. */
+static void confirmgroup__join(char **names, size_t *firsts, int first, int last, int *same, unsigned char **buffers)
+{
+  int fds[GROUP_MAX_FILES];
+  int batchlabels[GROUP_MAX_FILES];
+  int newcount;
+  int oldcount;
+  int n;
+  int o;
+  int b;
+
+  for (n = first; n < last; ++n)
+    same[n] = -1;
+
+  for (n = first; n < last; n += newcount) {
+    newcount = last - n < GROUP_MAX_FILES / 2 ? last - n : GROUP_MAX_FILES / 2;
+
+    for (o = 1; o < first; o += oldcount) {
+      oldcount = first - o < GROUP_MAX_FILES - newcount ? first - o : GROUP_MAX_FILES - newcount;
+
+      for (b = 0; b < newcount; ++b)
+        fds[b] = open(names[firsts[n + b]], O_RDONLY);
+      for (b = 0; b < oldcount; ++b)
+        fds[newcount + b] = open(names[firsts[o + b]], O_RDONLY);
+
+#ifdef HAVE_POSIX_FADVISE
+      for (b = 0; b < newcount + oldcount; ++b)
+        if (fds[b] >= 0)
+          posix_fadvise(fds[b], 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+      confirmgroup__batch(fds, newcount + oldcount, batchlabels, buffers);
+
+      /* the new files come first, so an earlier set matching one of
+         them takes that file's index as its label */
+      for (b = 0; b < oldcount; ++b)
+        if (batchlabels[newcount + b] >= 0 && batchlabels[newcount + b] < newcount)
+          same[n + batchlabels[newcount + b]] = o + b;
+
+      for (b = 0; b < newcount + oldcount; ++b)
+        if (fds[b] >= 0)
+          close(fds[b]);
+    }
+  }
+}
+
+/* Compare any number of files at once, reading each of them only once
+   (or, beyond GROUP_MAX_FILES files, reading the first file once per
+   batch, and the first file of each set found in a batch once more to
+   match it against the sets found in earlier batches). On return,
+   files with equal labels[] have identical contents, and files that
+   cannot be opened or read are labelled -1. */
+void confirmgroup(char **names, size_t count, int *labels)
+{
+  static unsigned char *buffers[GROUP_MAX_FILES];
+  int fds[GROUP_MAX_FILES];
+  int batchlabels[GROUP_MAX_FILES];
+  int map[GROUP_MAX_FILES];
+  size_t *firsts;
+  int *same;
+  size_t batchsize;
+  size_t start;
+  size_t b;
+  int batchfirst;
+  int nextlabel;
+  int newlabel;
+  int l;
+
+  /* windows are kept from one group to the next, like confirmmatch()'s */
+  for (b = 0; b < GROUP_MAX_FILES && b < count; ++b)
+    if (buffers[b] == 0)
+      buffers[b] = allocatewindow();
+
+  /* the first file of each set, and the set it turned out to join */
+  firsts = (size_t*) malloc(sizeof(size_t) * count);
+  same = (int*) malloc(sizeof(int) * count);
+  if (firsts == 0 || same == 0) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  labels[0] = -1;
+  firsts[0] = 0;
+  nextlabel = 1;
+
+  start = 1;
+  do {
+    /* every batch starts with the first file */
+    batchsize = 1;
+    fds[0] = open(names[0], O_RDONLY);
+    while (batchsize < GROUP_MAX_FILES && start + batchsize - 1 < count) {
+      fds[batchsize] = open(names[start + batchsize - 1], O_RDONLY);
+      ++batchsize;
+    }
+
+    for (b = 0; b < batchsize; ++b) {
+#ifdef HAVE_POSIX_FADVISE
+      if (fds[b] >= 0)
+        posix_fadvise(fds[b], 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+      map[b] = -1;
+    }
+
+    confirmgroup__batch(fds, batchsize, batchlabels, buffers);
+
+    for (b = 0; b < batchsize; ++b)
+      if (fds[b] >= 0)
+        close(fds[b]);
+
+    /* files matching the first file share its label across batches */
+    if (batchlabels[0] == 0) {
+      labels[0] = 0;
+      map[0] = 0;
+    }
+
+    batchfirst = nextlabel;
+
+    for (b = 1; b < batchsize; ++b) {
+      if (batchlabels[b] < 0)
+        labels[start + b - 1] = -1;
+      else {
+        if (map[batchlabels[b]] < 0) {
+          firsts[nextlabel] = start + b - 1;
+          map[batchlabels[b]] = nextlabel++;
+        }
+        labels[start + b - 1] = map[batchlabels[b]];
+      }
+    }
+
+    /* other sets may continue ones found in earlier batches */
+    if (batchfirst > 1 && nextlabel > batchfirst) {
+      confirmgroup__join(names, firsts, batchfirst, nextlabel, same, buffers);
+
+      /* sets that are new keep consecutive labels */
+      newlabel = batchfirst;
+      for (l = batchfirst; l < nextlabel; ++l) {
+        if (same[l] < 0) {
+          firsts[newlabel] = firsts[l];
+          same[l] = newlabel++;
+        }
+      }
+
+      for (b = start; b < start + batchsize - 1; ++b)
+        if (labels[b] >= batchfirst)
+          labels[b] = same[labels[b]];
+
+      nextlabel = newlabel;
+    }
+
+    start += batchsize - 1;
+  } while (start < count);
+
+  free(firsts);
+  free(same);
+}
@@ -24,6 +24,10 @@
 
 #include <stdio.h>
 
+/* maximum number of files open at once in confirmgroup() */
+#define GROUP_MAX_FILES 64
+
 int confirmmatch(FILE *file1, FILE *file2);
+void confirmgroup(char **names, size_t count, int *labels);
 
 #endif
\ No newline at end of file
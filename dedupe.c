@@ -0,0 +1,118 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include "dedupe.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+/* Make dest share source's extents using FIDEDUPERANGE. The kernel
+   locks both files and compares their contents before sharing anything,
+   so no separate byte-by-byte comparison is needed. Returns DEDUPE_OK
+   once the whole file is shared, DEDUPE_DIFFERS if the kernel found the
+   contents to differ, and DEDUPE_ERROR otherwise, setting errorstring. */
+int dedupefile(const file_t *source, const file_t *dest, char **errorstring)
+{
+  union {
+    struct file_dedupe_range range;
+    char space[sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info)];
+  } request;
+  struct file_dedupe_range_info *info;
+  off_t offset;
+  off_t length;
+  int result;
+  int sourcefd;
+  int destfd;
+
+  static char *shortdedupe = "Kernel stopped deduplicating before end of file";
+
+  sourcefd = open(source->d_name, O_RDONLY);
+  if (sourcefd < 0)
+  {
+    *errorstring = strerror(errno);
+    return DEDUPE_ERROR;
+  }
+
+  /* the kernel accepts a read-only destination from its owner */
+  destfd = open(dest->d_name, O_RDWR);
+  if (destfd < 0 && (errno == EACCES || errno == EPERM || errno == EROFS))
+    destfd = open(dest->d_name, O_RDONLY);
+
+  if (destfd < 0)
+  {
+    *errorstring = strerror(errno);
+    close(sourcefd);
+    return DEDUPE_ERROR;
+  }
+
+  info = &request.range.info[0];
+  result = DEDUPE_OK;
+
+  for (offset = 0; offset < source->size; offset += info->bytes_deduped)
+  {
+    length = source->size - offset;
+    if (length > DEDUPE_CHUNK_SIZE)
+      length = DEDUPE_CHUNK_SIZE;
+
+    memset(&request, 0, sizeof(request));
+    request.range.src_offset = offset;
+    request.range.src_length = length;
+    request.range.dest_count = 1;
+    info->dest_fd = destfd;
+    info->dest_offset = offset;
+
+    if (ioctl(sourcefd, FIDEDUPERANGE, &request.range) != 0)
+    {
+      *errorstring = strerror(errno);
+      result = DEDUPE_ERROR;
+      break;
+    }
+
+    if (info->status == FILE_DEDUPE_RANGE_DIFFERS)
+    {
+      result = DEDUPE_DIFFERS;
+      break;
+    }
+
+    if (info->status < 0)
+    {
+      *errorstring = strerror(-info->status);
+      result = DEDUPE_ERROR;
+      break;
+    }
+
+    if (info->bytes_deduped == 0)
+    {
+      *errorstring = shortdedupe;
+      result = DEDUPE_ERROR;
+      break;
+    }
+  }
+
+  close(destfd);
+  close(sourcefd);
+
+  return result;
+}
@@ -0,0 +1,149 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include "devicequeue.h"
+
+/* Set up a queue for count items, where keys[i] identifies the device
+   item i lives on. Items keep their relative order within each device.
+   A limit of 0 puts no bound on the number of active items per device.
+   Returns 0 if out of memory. */
+int devicequeue_init(struct devicequeue *queue, const unsigned long long *keys, size_t count, size_t limit)
+{
+  struct devicequeue_device *device;
+  size_t *fill;
+  size_t i;
+  size_t d;
+
+  queue->devices = 0;
+  queue->devicecount = 0;
+  queue->order = (size_t*) malloc(sizeof(size_t) * (count + 1));
+  queue->deviceof = (size_t*) malloc(sizeof(size_t) * (count + 1));
+  queue->remaining = count;
+  queue->cursor = 0;
+  queue->limit = limit;
+
+  if (queue->order == 0 || queue->deviceof == 0)
+  {
+    devicequeue_free(queue);
+    return 0;
+  }
+
+  /* few devices are expected, so a linear search for each item will do */
+  for (i = 0; i < count; ++i)
+  {
+    for (d = 0; d < queue->devicecount; ++d)
+      if (queue->devices[d].key == keys[i])
+        break;
+
+    if (d == queue->devicecount)
+    {
+      device = (struct devicequeue_device*) realloc(queue->devices, sizeof(struct devicequeue_device) * (d + 1));
+      if (device == 0)
+      {
+        devicequeue_free(queue);
+        return 0;
+      }
+
+      queue->devices = device;
+      queue->devices[d].key = keys[i];
+      queue->devices[d].count = 0;
+      queue->devices[d].next = 0;
+      queue->devices[d].active = 0;
+      ++queue->devicecount;
+    }
+
+    queue->deviceof[i] = d;
+    ++queue->devices[d].count;
+  }
+
+  fill = (size_t*) malloc(sizeof(size_t) * (queue->devicecount + 1));
+  if (fill == 0)
+  {
+    devicequeue_free(queue);
+    return 0;
+  }
+
+  for (d = 0, i = 0; d < queue->devicecount; ++d)
+  {
+    queue->devices[d].first = i;
+    fill[d] = i;
+    i += queue->devices[d].count;
+  }
+
+  for (i = 0; i < count; ++i)
+    queue->order[fill[queue->deviceof[i]]++] = i;
+
+  free(fill);
+
+  return 1;
+}
+
+/* Take the next item from the first device after the one last served
+   that has items left and is under its limit. Returns 0 if there is no
+   such device, either because every item has been taken or because
+   every device with items left is at its limit. */
+int devicequeue_take(struct devicequeue *queue, size_t *item)
+{
+  struct devicequeue_device *device;
+  size_t n;
+  size_t d;
+
+  for (n = 0; n < queue->devicecount; ++n)
+  {
+    d = (queue->cursor + n) % queue->devicecount;
+    device = &queue->devices[d];
+
+    if (device->next == device->count)
+      continue;
+
+    if (queue->limit != 0 && device->active >= queue->limit)
+      continue;
+
+    *item = queue->order[device->first + device->next++];
+    ++device->active;
+    --queue->remaining;
+
+    queue->cursor = d + 1;
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Mark an item taken from the queue as no longer active. */
+void devicequeue_release(struct devicequeue *queue, size_t item)
+{
+  --queue->devices[queue->deviceof[item]].active;
+}
+
+void devicequeue_free(struct devicequeue *queue)
+{
+  free(queue->devices);
+  free(queue->order);
+  free(queue->deviceof);
+
+  queue->devices = 0;
+  queue->order = 0;
+  queue->deviceof = 0;
+}
@@ -0,0 +1,55 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef DEVICEQUEUE_H
+#define DEVICEQUEUE_H
+
+#include <stddef.h>
+
+struct devicequeue_device
+{
+  unsigned long long key;
+  size_t first; /* first of this device's items in devicequeue.order */
+  size_t count;
+  size_t next;
+  size_t active;
+};
+
+/* Items split into one queue per device, taken round-robin across
+   devices with at most 'limit' items active on any one device at a
+   time. Not thread-safe; callers must serialize access. */
+struct devicequeue
+{
+  struct devicequeue_device *devices;
+  size_t devicecount;
+  size_t *order;
+  size_t *deviceof;
+  size_t remaining;
+  size_t cursor;
+  size_t limit;
+};
+
+int devicequeue_init(struct devicequeue *queue, const unsigned long long *keys, size_t count, size_t limit);
+int devicequeue_take(struct devicequeue *queue, size_t *item);
+void devicequeue_release(struct devicequeue *queue, size_t item);
+void devicequeue_free(struct devicequeue *queue);
+
+#endif
@@ -0,0 +1,226 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef USE_STATX
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+#include "dirreader.h"
+
+#ifdef USE_STATX
+
+/* Linux scanner: read entries with large getdents64() calls and fetch
+   only the attributes fdupes uses with statx(). */
+
+#define STATX_FIELDS (STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME)
+
+struct linux_dirent64
+{
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct dirreader
+{
+  int fd;
+  char *path;
+  char *buffer;
+  long length;
+  long position;
+};
+
+struct dirreader *dirreader_open(char *path)
+{
+  struct dirreader *reader;
+
+  reader = (struct dirreader*) malloc(sizeof(struct dirreader));
+  if (reader == 0)
+    return 0;
+
+  reader->buffer = (char*) malloc(DIRECTORY_BUFFER_SIZE);
+  if (reader->buffer == 0) {
+    free(reader);
+    return 0;
+  }
+
+  reader->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (reader->fd == -1) {
+    free(reader->buffer);
+    free(reader);
+    return 0;
+  }
+
+  reader->path = path;
+  reader->length = 0;
+  reader->position = 0;
+
+  return reader;
+}
+
+int dirreader_next(struct dirreader *reader, char **name, int *type)
+{
+  struct linux_dirent64 *entry;
+
+  if (reader->position >= reader->length) {
+    reader->length = syscall(SYS_getdents64, reader->fd, reader->buffer, DIRECTORY_BUFFER_SIZE);
+    reader->position = 0;
+
+    if (reader->length < 0) {
+      reader->length = 0;
+      return -1;
+    }
+
+    if (reader->length == 0)
+      return 0;
+  }
+
+  entry = (struct linux_dirent64*) (reader->buffer + reader->position);
+  reader->position += entry->d_reclen;
+
+  *name = entry->d_name;
+  *type = entry->d_type;
+
+  return 1;
+}
+
+int dirreader_stat(struct dirreader *reader, char *name, struct stat *info, int nofollow)
+{
+  struct statx stx;
+
+  if (statx(reader->fd, name, AT_NO_AUTOMOUNT | (nofollow ? AT_SYMLINK_NOFOLLOW : 0), STATX_FIELDS, &stx) != 0)
+    return -1;
+
+  /* file systems may leave out fields they cannot provide cheaply */
+  if ((stx.stx_mask & STATX_FIELDS) != STATX_FIELDS)
+    return fstatat(reader->fd, name, info, AT_NO_AUTOMOUNT | (nofollow ? AT_SYMLINK_NOFOLLOW : 0));
+
+  memset(info, 0, sizeof(struct stat));
+
+  info->st_mode = stx.stx_mode;
+  info->st_ino = stx.stx_ino;
+  info->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  info->st_size = stx.stx_size;
+  info->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  info->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  info->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+  info->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+  return 0;
+}
+
+void dirreader_close(struct dirreader *reader)
+{
+  close(reader->fd);
+  free(reader->buffer);
+  free(reader);
+}
+
+#else
+
+/* Portable scanner: readdir(), with fstatat() relative to the open
+   directory where available. */
+
+struct dirreader
+{
+  DIR *dir;
+  char *path;
+};
+
+struct dirreader *dirreader_open(char *path)
+{
+  struct dirreader *reader;
+
+  reader = (struct dirreader*) malloc(sizeof(struct dirreader));
+  if (reader == 0)
+    return 0;
+
+  reader->dir = opendir(path);
+  if (reader->dir == 0) {
+    free(reader);
+    return 0;
+  }
+
+  reader->path = path;
+
+  return reader;
+}
+
+int dirreader_next(struct dirreader *reader, char **name, int *type)
+{
+  struct dirent *entry;
+
+  errno = 0;
+
+  entry = readdir(reader->dir);
+  if (entry == 0)
+    return errno == 0 ? 0 : -1;
+
+  *name = entry->d_name;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+  *type = entry->d_type;
+#else
+  *type = DT_UNKNOWN;
+#endif
+
+  return 1;
+}
+
+int dirreader_stat(struct dirreader *reader, char *name, struct stat *info, int nofollow)
+{
+#ifdef HAVE_FSTATAT
+  return fstatat(dirfd(reader->dir), name, info, nofollow ? AT_SYMLINK_NOFOLLOW : 0);
+#else
+  char *path;
+  int result;
+
+  path = (char*) malloc(strlen(reader->path) + strlen(name) + 2);
+  if (path == 0)
+    return -1;
+
+  strcpy(path, reader->path);
+  if (reader->path[0] != '\0' && reader->path[strlen(reader->path) - 1] != '/')
+    strcat(path, "/");
+  strcat(path, name);
+
+  result = nofollow ? lstat(path, info) : stat(path, info);
+
+  free(path);
+
+  return result;
+#endif
+}
+
+void dirreader_close(struct dirreader *reader)
+{
+  closedir(reader->dir);
+  free(reader);
+}
+
+#endif
@@ -0,0 +1,46 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef DIRREADER_H
+#define DIRREADER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#if !defined(HAVE_STRUCT_DIRENT_D_TYPE) || !defined(DT_UNKNOWN)
+  #undef HAVE_STRUCT_DIRENT_D_TYPE
+  #define DT_UNKNOWN 0
+  #define DT_DIR 4
+  #define DT_REG 8
+  #define DT_LNK 10
+#endif
+
+struct dirreader;
+
+struct dirreader *dirreader_open(char *path);
+/* Returns 1 for each entry, 0 at the end of the directory, and -1 (see
+   errno) if the directory could not be read to its end. */
+int dirreader_next(struct dirreader *reader, char **name, int *type);
+int dirreader_stat(struct dirreader *reader, char *name, struct stat *info, int nofollow);
+void dirreader_close(struct dirreader *reader);
+
+#endif
@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
@@ -51,9 +52,31 @@
 #include "sigint.h"
 #include "flags.h"
 #include "removeifnotchanged.h"
+#include "sdirname.h"
+#include "arena.h"
+#include "dirreader.h"
+#include "sizegroup.h"
+#include "stats.h"
+#include "stages.h"
+#include "ioorder.h"
+#include "matchwriter.h"
+#ifndef NO_THREADS
+  #include <pthread.h>
+  #include "workqueue.h"
+#endif
+#ifdef HAVE_IO_URING
+  #include "uringsignatures.h"
+#endif
+#ifdef HAVE_MMAP_IO
+  #include "mmapio.h"
+#endif
+#ifdef HAVE_FIDEDUPERANGE
+  #include "dedupe.h"
+#endif
 #ifndef NO_SQLITE
 #define FDUPES_DATABASE_DIRECTORY FDUPES_CACHE_DIRECTORY "/" FDUPES_HASH_DATABASE_NAME
   #include "hashdb.h"
+  #include "listing.h"
   #include "getrealpath.h"
   #include "xdgbase.h"
 #endif
@@ -67,6 +90,12 @@ char *program_name;
 long long minsize = -1;
 long long maxsize = -1;
 
+int threads = 1;
+
+/* holds every file_t considered, along with its name and path */
+struct arena filearena;
+size_t devicedepth = 0;
+
 #ifndef NO_SQLITE
 sqlite3 *db;
 #endif
@@ -81,7 +110,21 @@ typedef enum {
 
 ordertype_t ordertype = ORDER_MTIME;
 
-#define MD5_DIGEST_LENGTH 16
+iotype_t iomode = IO_STDIO;
+
+/* options that only exist in long form */
+enum {
+  OPT_STATS = 256,
+  OPT_IO,
+  OPT_HASH,
+  OPT_STAGES,
+  OPT_IO_ORDER,
+  OPT_DEVICE_DEPTH,
+  OPT_DEDUPE,
+  OPT_LINK,
+  OPT_FORMAT,
+  OPT_STREAM
+};
 
 typedef struct _filetree {
   file_t *file; 
@@ -112,13 +155,14 @@ void escapefilename(char *escape_list, char **filename_ptr)
   tmp[tx] = '\0';
 
   if (x != tx) {
-    *filename_ptr = realloc(*filename_ptr, strlen(tmp) + 1);
+    *filename_ptr = arena_strdup(&filearena, tmp);
     if (*filename_ptr == NULL) {
       errormsg("out of memory!\n");
       exit(1);
     }
-    strcpy(*filename_ptr, tmp);
   }
+
+  free(tmp);
 }
 
 dev_t getdevice(char *filename) {
@@ -252,6 +296,74 @@ void getfilestats(file_t *file, struct stat *info, struct stat *linfo)
 }
 
 #ifndef NO_SQLITE
+/* A cache entry found missing, to be deleted by flushdelistings(): a
+   directory if filename is 0, else a file's hashes. */
+struct delisting
+{
+  sqlite3_int64 directoryid;
+  char *filename;
+};
+
+struct delisting *delistings = 0;
+size_t delistingcount = 0;
+size_t delistingsallocated = 0;
+
+void delistlater(sqlite3_int64 directoryid, const char *filename)
+{
+  struct delisting *grown;
+
+  if (delistingcount == delistingsallocated)
+  {
+    delistingsallocated = delistingsallocated == 0 ? 64 : delistingsallocated * 2;
+
+    grown = (struct delisting*) realloc(delistings, sizeof(struct delisting) * delistingsallocated);
+    if (grown == 0) {
+      errormsg("out of memory!\n");
+      exit(1);
+    }
+
+    delistings = grown;
+  }
+
+  delistings[delistingcount].directoryid = directoryid;
+  delistings[delistingcount].filename = 0;
+
+  if (filename != 0)
+  {
+    delistings[delistingcount].filename = strdup(filename);
+    if (delistings[delistingcount].filename == 0) {
+      errormsg("out of memory!\n");
+      exit(1);
+    }
+  }
+
+  ++delistingcount;
+}
+
+/* Delete the cache entries found missing. Deletion waits until after
+   matching, so that files renamed or moved since the last run may still
+   find their hashes under the old path; see loadcachedhash(). */
+void flushdelistings()
+{
+  size_t d;
+
+  for (d = 0; d < delistingcount; ++d)
+  {
+    if (delistings[d].filename == 0)
+      hashdb_deletedirectory(db, delistings[d].directoryid);
+    else
+      hashdb_deletehash(db, delistings[d].directoryid, delistings[d].filename);
+
+    free(delistings[d].filename);
+  }
+
+  free(delistings);
+
+  delistings = 0;
+  delistingcount = 0;
+  delistingsallocated = 0;
+}
+
 int delist_hash_if_orphaned(const sqlite3_int64 directoryid, const char *filename, const char *directory)
 {
   const char *path;
@@ -271,7 +383,7 @@ int delist_hash_if_orphaned(const sqlite3_int64 directoryid, const char *filenam
   strcat(fullpath, filename);
 
   if (access(fullpath, F_OK) != 0)
-    hashdb_deletehash(db, directoryid, filename);
+    delistlater(directoryid, filename);
 
   free(fullpath);
 
@@ -286,258 +398,1361 @@ int delist_directory_if_missing(const sqlite3_int64 directoryid, const char *nam
     return 0;
 
   if (lstat(full_path, &st) != 0 || !S_ISDIR(st.st_mode))
-    return hashdb_deletedirectory(db, directoryid);
+    delistlater(directoryid, 0);
 
   return 1;
 }
 #endif
 
-int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
+void showbuildprogress()
 {
-  DIR *cd;
-  file_t *newfile;
-  struct dirent *dirinfo;
-  int lastchar;
-  int filecount = 0;
-  int filesadded;
-  struct stat info;
-  struct stat linfo;
   static int progress = 0;
   static char indicator[] = "-\\|/";
   static uint64_t last_progress = 0;
-  static uint64_t now = 0;
-  char *fullname, *name;
-  char *fullpath = 0;
+  uint64_t now;
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    now = now64();
+    if ( now - last_progress > FDUPES_PROGRESS_REFRESH_MS ) {
+      fprintf(stderr, "\rBuilding file list %c ", indicator[progress % 4]);
+      last_progress = now;
+      progress++;
+    }
+  }
+}
+
+/* Record a directory about to be scanned. Its prefix is dir followed
+   by a '/' if it does not already end in one. When hashes are cached,
+   its real path is resolved here, once for all the files in it, and is
+   derived from its parent's unless a link must be followed to reach it.
+   Safe to call from several threads at once. */
+struct directory *newdirectory(const char *dir, struct directory *parent, int islink)
+{
+  struct directory *directory;
+  size_t length;
 #ifndef NO_SQLITE
-  sqlite3_int64 pathid = 0;
+  const char *name;
+  char *fullpath;
 #endif
 
-  cd = opendir(dir);
+  directory = (struct directory*) arena_alloc(&filearena, sizeof(struct directory));
+  if (directory == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  length = strlen(dir);
 
-  if (!cd) {
-    errormsg("could not chdir to %s\n", dir);
-    return 0;
+  directory->prefix = arena_strjoin(&filearena, dir, length > 0 && dir[length - 1] != '/' ? "/" : "");
+  if (directory->prefix == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
   }
 
+  directory->realpath = 0;
+  directory->parent = parent;
+  directory->cacheid = DIRECTORY_ID_UNKNOWN;
+  directory->preloaded = 0;
+
 #ifndef NO_SQLITE
   if (db != 0) {
-    fullpath = getrealpath(dir, 0);
-
-    if (fullpath && !ISFLAG(flags, F_READONLYCACHE)) {
-      if (hashdb_getdirectoryid(db, fullpath, &pathid)) {
-        hashdb_foreachdirectory(db, &pathid, delist_directory_if_missing);
-        hashdb_foreachhash(db, &pathid, delist_hash_if_orphaned);
+    if (parent != 0 && parent->realpath != 0 && !islink) {
+      /* dir is parent->prefix followed by the directory's name */
+      name = dir + strlen(parent->prefix);
+      length = strlen(parent->realpath);
+
+      fullpath = (char*) malloc(length + strlen(name) + 2);
+      if (fullpath == NULL) {
+        errormsg("out of memory!\n");
+        exit(1);
       }
+
+      sprintf(fullpath, "%s%s%s", parent->realpath, length > 0 && parent->realpath[length - 1] != '/' ? "/" : "", name);
+    } else {
+      fullpath = getrealpath(dir, 0);
+    }
+
+    if (fullpath != 0) {
+      directory->realpath = arena_strdup(&filearena, fullpath);
+      free(fullpath);
+    }
+  }
+#endif
+
+  return directory;
+}
+
+/* Return a file's full path, building it the first time it is needed.
+   Paths are only built, on the main thread, for files sharing their size
+   with others, since only those are ever opened or listed. */
+char *filepath(file_t *file)
+{
+  if (file->d_name == NULL) {
+    file->d_name = arena_strjoin(&filearena, file->directory->prefix, file->name);
+    if (file->d_name == NULL) {
+      errormsg("out of memory!\n");
+      exit(1);
+    }
+  }
+
+  return file->d_name;
+}
+
+/* Allocate a file_t for an entry of directory: from filearena for
+   files, which hold the entry's name, or with malloc() for directories,
+   which are only kept while they are scanned and hold their full path
+   instead. */
+file_t *newentry(struct directory *directory, const char *name, int isdirectory, int islink)
+{
+  file_t *newfile;
+  int s;
+
+  if (isdirectory)
+    newfile = (file_t*) malloc(sizeof(file_t) + 1);
+  else
+    newfile = (file_t*) arena_alloc(&filearena, sizeof(file_t) + strlen(name) + 1);
+
+  if (!newfile) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  newfile->next = NULL;
+  newfile->device = 0;
+  newfile->inode = 0;
+  newfile->hashes = 0;
+  for (s = 0; s < MAX_STAGES; ++s)
+    newfile->crcstages[s] = NULL;
+  newfile->stagesreached = 0;
+  newfile->locationtype = LOCATION_UNKNOWN;
+  newfile->location = 0;
+  newfile->duplicates = NULL;
+  newfile->hasdupes = 0;
+  newfile->islink = islink;
+  newfile->directory = directory;
+
+  if (isdirectory) {
+    newfile->name[0] = '\0';
+    newfile->d_name = (char*)malloc(strlen(directory->prefix)+strlen(name)+1);
+
+    if (!newfile->d_name) {
+      errormsg("out of memory!\n");
+      free(newfile);
+      exit(1);
+    }
+
+    strcpy(newfile->d_name, directory->prefix);
+    strcat(newfile->d_name, name);
+  } else {
+    strcpy(newfile->name, name);
+    newfile->d_name = NULL;
+  }
+
+  return newfile;
+}
+
+#define ENTRY_SKIP 0
+#define ENTRY_FILE 1
+#define ENTRY_DIRECTORY 2
+
+/* Decide whether a directory entry is a file to consider, a directory
+   to descend into, or neither, and if either, have *newfilep receive a
+   file_t for it (see newentry()). The entry type reported by the
+   directory reader is used to skip stat() and lstat() calls whenever
+   their outcome is already known; the number of calls actually made is
+   added to *metadatacalls. Safe to call from several threads at once. */
+int examineentry(struct dirreader *reader, struct directory *directory, char *name, int type, struct stat *logfile_status, file_t **newfilep, unsigned long long *metadatacalls)
+{
+  file_t *newfile;
+  int isdirectory;
+  int isregular;
+  int islink;
+  struct stat info;
+  struct stat linfo;
+
+  if (ISFLAG(flags, F_EXCLUDEHIDDEN) && name[0] == '.')
+    return ENTRY_SKIP;
+
+  switch (type)
+  {
+  case DT_DIR:
+    if (!ISFLAG(flags, F_RECURSE))
+      return ENTRY_SKIP;
+    break;
+
+  case DT_LNK:
+    /* neither a link to a file nor a link to a directory is followed */
+    if (!ISFLAG(flags, F_FOLLOWLINKS))
+      return ENTRY_SKIP;
+    break;
+
+  case DT_REG:
+  case DT_UNKNOWN:
+    break;
+
+  default: /* devices, pipes and sockets are never considered */
+    return ENTRY_SKIP;
+  }
+
+  if (type == DT_DIR) {
+    isdirectory = 1;
+    isregular = 0;
+    islink = 0;
+  } else {
+    ++*metadatacalls;
+    if (dirreader_stat(reader, name, &info, 0) == -1)
+      return ENTRY_SKIP;
+
+    isdirectory = S_ISDIR(info.st_mode);
+
+    if (!isdirectory && (((info.st_size == 0 && ISFLAG(flags, F_EXCLUDEEMPTY)) || info.st_size < minsize || (info.st_size > maxsize && maxsize != -1))))
+      return ENTRY_SKIP;
+
+    /* ignore logfile */
+    if (logfile_status != 0 && info.st_dev == logfile_status->st_dev && info.st_ino == logfile_status->st_ino)
+      return ENTRY_SKIP;
+
+    if (type == DT_UNKNOWN) {
+      ++*metadatacalls;
+      if (dirreader_stat(reader, name, &linfo, 1) == -1)
+        return ENTRY_SKIP;
+
+      isregular = S_ISREG(linfo.st_mode);
+      islink = S_ISLNK(linfo.st_mode);
+    } else {
+      isregular = type == DT_REG;
+      islink = type == DT_LNK;
+    }
+  }
+
+  if (isdirectory) {
+    if (!ISFLAG(flags, F_RECURSE) || (islink && !ISFLAG(flags, F_FOLLOWLINKS)))
+      return ENTRY_SKIP;
+  } else {
+    if (!isregular && !(islink && ISFLAG(flags, F_FOLLOWLINKS)))
+      return ENTRY_SKIP;
+  }
+
+  newfile = newentry(directory, name, isdirectory, islink);
+
+  if (!isdirectory)
+    getfilestats(newfile, &info, &linfo);
+
+  *newfilep = newfile;
+
+  return isdirectory ? ENTRY_DIRECTORY : ENTRY_FILE;
+}
+
+#ifndef NO_SQLITE
+/* look up a directory in the cache, delisting any entries beneath it that no longer exist */
+void delist_missing_within(struct directory *directory, sqlite3_int64 *pathid)
+{
+  *pathid = 0;
+
+  if (db != 0 && directory->realpath != 0 && !ISFLAG(flags, F_READONLYCACHE)) {
+    if (hashdb_getdirectoryid(db, directory->realpath, pathid)) {
+      directory->cacheid = *pathid;
+
+      hashdb_foreachdirectory(db, pathid, delist_directory_if_missing);
+      hashdb_foreachhash(db, pathid, delist_hash_if_orphaned);
+    } else {
+      directory->cacheid = DIRECTORY_ID_MISSING;
     }
   }
+}
 #endif
 
-  while ((dirinfo = readdir(cd)) != NULL) {
+int grokdirectory(char *dir, struct directory *parent, int islink, file_t **filelistp, struct stat *logfile_status);
+
+#ifndef NO_SQLITE
+/* Describe the options that decide which entries of a directory a scan
+   keeps, so that a listing recorded under other options is not reused. */
+void scanoptions(char *options, size_t size, struct stat *logfile_status)
+{
+  snprintf(options, size, "%lx %lld %lld %llu:%llu",
+    flags & (F_RECURSE | F_FOLLOWLINKS | F_EXCLUDEHIDDEN | F_EXCLUDEEMPTY),
+    minsize,
+    maxsize,
+    logfile_status ? (unsigned long long) logfile_status->st_dev : 0,
+    logfile_status ? (unsigned long long) logfile_status->st_ino : 0);
+}
+
+/* Add the files of an unchanged directory to the file list from the
+   listing recorded when it was last scanned, for -x cache.trustdirectories.
+   Neither the directory nor its files are read; its subdirectories are
+   still checked in turn. */
+int grokunchanged(struct directory *directory, struct listing *listing, file_t **filelistp, struct stat *logfile_status)
+{
+  struct hashdb_preload preload;
+  struct listingentry entry;
+  file_t *newfile;
+  size_t offset = 0;
+  int filecount = 0;
+
+  hashdb_preloaddirectory(db, directory, &preload);
+
+  while (listing_next(listing->data, listing->size, &offset, &entry) == 1) {
     if (got_sigint) {
-      closedir(cd);
       printf("\n");
       exit(0);
     }
 
-    if (strcmp(dirinfo->d_name, ".") && strcmp(dirinfo->d_name, "..")) {
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-        now = now64();
-        if ( now - last_progress > FDUPES_PROGRESS_REFRESH_MS ) {
-          fprintf(stderr, "\rBuilding file list %c ", indicator[progress % 4]);
-          last_progress = now;
-          progress++;
-        }
-      }
+    showbuildprogress();
 
-      newfile = (file_t*) malloc(sizeof(file_t));
+    newfile = newentry(directory, entry.name, entry.isdirectory, entry.islink);
 
-      if (!newfile) {
-	errormsg("out of memory!\n");
-	closedir(cd);
-	exit(1);
-      } else newfile->next = *filelistp;
+    if (entry.isdirectory) {
+      filecount += grokdirectory(newfile->d_name, directory, entry.islink, filelistp, logfile_status);
 
-      newfile->device = 0;
-      newfile->inode = 0;
-      newfile->crcsignature = NULL;
-      newfile->crcpartial = NULL;
-      newfile->duplicates = NULL;
-      newfile->hasdupes = 0;
+      free(newfile->d_name);
+      free(newfile);
+    } else {
+      newfile->device = entry.device;
+      newfile->inode = entry.inode;
+      newfile->size = entry.size;
+      newfile->mtime = entry.mtime;
+      newfile->ctime = entry.ctime;
+      newfile->mtime_nsec = entry.mtime_nsec;
+      newfile->ctime_nsec = entry.ctime_nsec;
+
+      hashdb_applypreload(&preload, newfile);
+
+      newfile->next = *filelistp;
+      *filelistp = newfile;
+      filecount++;
+    }
+  }
 
-      newfile->d_name = (char*)malloc(strlen(dir)+strlen(dirinfo->d_name)+2);
+  hashdb_freepreload(&preload);
 
-      if (!newfile->d_name) {
-	errormsg("out of memory!\n");
-	free(newfile);
-	closedir(cd);
-	exit(1);
-      }
+  return filecount;
+}
+#endif
 
-      strcpy(newfile->d_name, dir);
-      lastchar = strlen(dir) - 1;
-      if (lastchar >= 0 && dir[lastchar] != '/')
-	strcat(newfile->d_name, "/");
-      strcat(newfile->d_name, dirinfo->d_name);
-      
-      if (ISFLAG(flags, F_EXCLUDEHIDDEN)) {
-	fullname = strdup(newfile->d_name);
-	if (fullname == 0)
-	{
-	  errormsg("out of memory!\n");
-	  free(newfile);
-	  closedir(cd);
-	  exit(1);
-	}
-	name = basename(fullname);
-	if (name[0] == '.' && strcmp(name, ".") && strcmp(name, "..") ) {
-	  free(newfile->d_name);
-	  free(newfile);
-	  free(fullname);
-	  continue;
-	}
-	free(fullname);
-      }
+/* Scan dir, found in parent (0 for directories named on the command
+   line) through a symbolic link if islink is set. */
+int grokdirectory(char *dir, struct directory *parent, int islink, file_t **filelistp, struct stat *logfile_status)
+{
+  struct dirreader *cd;
+  struct directory *directory = 0;
+  file_t *newfile;
+  char *name;
+  int type;
+  int filecount = 0;
+  int filesadded;
+  int readresult;
+  unsigned long long entries = 0;
+  unsigned long long metadatacalls = 0;
+#ifndef NO_SQLITE
+  sqlite3_int64 pathid = 0;
+  struct hashdb_preload preload = { 0, 0 };
+  struct listing listing;
+  struct stat status;
+  char options[128];
+  int recordlisting = 0;
 
-      if (stat(newfile->d_name, &info) == -1) {
-        free(newfile->d_name);
-        free(newfile);
-        continue;
-      }
-      
-      if (!S_ISDIR(info.st_mode) && (((info.st_size == 0 && ISFLAG(flags, F_EXCLUDEEMPTY)) || info.st_size < minsize || (info.st_size > maxsize && maxsize != -1)))) {
-        free(newfile->d_name);
-        free(newfile);
-        continue;
-      }
+  /* reuse what an unchanged directory held last time, if trusted to */
+  if (db != 0 && ISFLAG(flags, F_TRUSTDIRECTORIES) && stat(dir, &status) == 0) {
+    stats_add(&stats.metadatacalls, 1);
+
+    scanoptions(options, sizeof(options), logfile_status);
+
+    directory = newdirectory(dir, parent, islink);
+
+    if (hashdb_loadlisting(db, directory, &status, options, &listing)) {
+      filecount = grokunchanged(directory, &listing, filelistp, logfile_status);
+      listing_free(&listing);
+      return filecount;
+    }
+
+    recordlisting = !ISFLAG(flags, F_READONLYCACHE);
+  }
+#endif
+
+  cd = dirreader_open(dir);
+
+  if (!cd) {
+    errormsg("could not chdir to %s\n", dir);
+    return 0;
+  }
 
-      /* ignore logfile */
-      if (logfile_status != 0 && info.st_dev == logfile_status->st_dev && info.st_ino == logfile_status->st_ino)
+  if (directory == 0)
+    directory = newdirectory(dir, parent, islink);
+
+#ifndef NO_SQLITE
+  delist_missing_within(directory, &pathid);
+
+  if (db != 0)
+    hashdb_preloaddirectory(db, directory, &preload);
+
+  if (recordlisting)
+    listing_init(&listing);
+#endif
+
+  while ((readresult = dirreader_next(cd, &name, &type)) > 0) {
+    if (got_sigint) {
+      dirreader_close(cd);
+      printf("\n");
+      exit(0);
+    }
+
+    if (strcmp(name, ".") && strcmp(name, "..")) {
+      showbuildprogress();
+
+      ++entries;
+
+      switch (examineentry(cd, directory, name, type, logfile_status, &newfile, &metadatacalls))
       {
+      case ENTRY_DIRECTORY:
+#ifndef NO_SQLITE
+        if (recordlisting)
+          listing_adddirectory(&listing, name, newfile->islink);
+#endif
+
+        filesadded = grokdirectory(newfile->d_name, directory, newfile->islink, filelistp, logfile_status);
+        filecount += filesadded;
+
+#ifndef NO_SQLITE
+        if (db != 0 && pathid == 0 && !ISFLAG(flags, F_READONLYCACHE) && filesadded > 0 && directory->realpath != 0) {
+          hashdb_savedirectory(db, directory->realpath);
+          directory->cacheid = DIRECTORY_ID_UNKNOWN;
+        }
+#endif
+
         free(newfile->d_name);
         free(newfile);
-        continue;
-      }
+        break;
 
-      if (lstat(newfile->d_name, &linfo) == -1) {
-	free(newfile->d_name);
-	free(newfile);
-	continue;
+      case ENTRY_FILE:
+#ifndef NO_SQLITE
+        hashdb_applypreload(&preload, newfile);
+
+        if (recordlisting)
+          listing_addfile(&listing, newfile);
+#endif
+
+        newfile->next = *filelistp;
+        *filelistp = newfile;
+        filecount++;
+        break;
       }
+    }
+  }
 
-      if (S_ISDIR(info.st_mode)) {
-        if (ISFLAG(flags, F_RECURSE) && (ISFLAG(flags, F_FOLLOWLINKS) || !S_ISLNK(linfo.st_mode)))
-        {
-          filesadded = grokdir(newfile->d_name, filelistp, logfile_status);
-          filecount += filesadded;
+  if (readresult < 0)
+    errormsg("could not read all of %s: %s\n", dir, strerror(errno));
+
+  dirreader_close(cd);
 
 #ifndef NO_SQLITE
-          if (db != 0 && pathid == 0 && !ISFLAG(flags, F_READONLYCACHE) && filesadded > 0)
-              hashdb_savedirectory(db, fullpath);
+  hashdb_freepreload(&preload);
+
+  if (recordlisting) {
+    /* a directory changed within the last second could change again
+       without its times changing, so is not trusted; nor is a listing
+       that could not be read to its end */
+    if (status.st_ctime + 1 < time(0) && readresult == 0)
+      hashdb_savelisting(db, directory, &status, options, &listing);
+
+    listing_free(&listing);
+  }
 #endif
-        }
-	free(newfile->d_name);
-	free(newfile);
-      } else {
-	if (S_ISREG(linfo.st_mode) || (S_ISLNK(linfo.st_mode) && ISFLAG(flags, F_FOLLOWLINKS))) {
-	  getfilestats(newfile, &info, &linfo);
-	  *filelistp = newfile;
-	  filecount++;
-	} else {
-	  free(newfile->d_name);
-	  free(newfile);
-	}
-      }
-    }
+
+  stats_add(&stats.entries, entries);
+  stats_add(&stats.metadatacalls, metadatacalls);
+
+  return filecount;
+}
+
+int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
+{
+  return grokdirectory(dir, 0, 0, filelistp, logfile_status);
+}
+
+#ifndef NO_THREADS
+/* A directory scanned by scandirectory(). Its entries are kept in
+   readdir order so that, once every directory has been scanned, the
+   results can be combined into exactly the list grokdir() builds. */
+struct scannode
+{
+  char *path;
+  struct directory *parent;
+  int islink;
+  struct directory *directory; /* set once scanned */
+  int failed;
+  int readerror; /* errno, if entries were left unread */
+  struct scanitem *items;
+  size_t count;
+  size_t allocated;
+  struct scannode *nextpending;
+};
+
+struct scanitem
+{
+  file_t *file;
+  struct scannode *subdirectory; /* non-zero if file is a directory */
+};
+
+struct scanqueue
+{
+  struct scannode *pending;
+  int scanning;
+  int running;
+  struct stat *logfile_status;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+};
+
+struct scannode *newscannode(char *path, struct directory *parent, int islink)
+{
+  struct scannode *node;
+
+  node = (struct scannode*) malloc(sizeof(struct scannode));
+  if (node == 0) {
+    errormsg("out of memory!\n");
+    exit(1);
   }
 
-  if (fullpath)
-    free(fullpath);
+  node->path = path;
+  node->parent = parent;
+  node->islink = islink;
+  node->directory = 0;
+  node->failed = 0;
+  node->readerror = 0;
+  node->items = 0;
+  node->count = 0;
+  node->allocated = 0;
+  node->nextpending = 0;
+
+  return node;
+}
+
+void scannode(struct scanqueue *queue, struct scannode *node)
+{
+  struct dirreader *cd;
+  char *name;
+  int type;
+  struct scanitem *items;
+  struct scannode *subdirectory;
+  file_t *newfile;
+  int kind;
+  int readresult;
+  unsigned long long entries = 0;
+  unsigned long long metadatacalls = 0;
+
+  cd = dirreader_open(node->path);
+
+  if (!cd) {
+    node->failed = 1;
+    return;
+  }
+
+  node->directory = newdirectory(node->path, node->parent, node->islink);
+
+  while ((readresult = dirreader_next(cd, &name, &type)) > 0 && !got_sigint) {
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+      continue;
+
+    ++entries;
+
+    kind = examineentry(cd, node->directory, name, type, queue->logfile_status, &newfile, &metadatacalls);
+    if (kind == ENTRY_SKIP)
+      continue;
+
+    if (node->count == node->allocated) {
+      node->allocated = node->allocated ? node->allocated * 2 : 16;
+
+      items = (struct scanitem*) realloc(node->items, sizeof(struct scanitem) * node->allocated);
+      if (items == 0) {
+        errormsg("out of memory!\n");
+        exit(1);
+      }
+
+      node->items = items;
+    }
+
+    node->items[node->count].file = newfile;
+    node->items[node->count].subdirectory = 0;
+
+    if (kind == ENTRY_DIRECTORY) {
+      subdirectory = newscannode(newfile->d_name, node->directory, newfile->islink);
+      node->items[node->count].subdirectory = subdirectory;
+
+      pthread_mutex_lock(&queue->mutex);
+      subdirectory->nextpending = queue->pending;
+      queue->pending = subdirectory;
+      pthread_cond_signal(&queue->changed);
+      pthread_mutex_unlock(&queue->mutex);
+    }
+
+    ++node->count;
+  }
+
+  if (readresult < 0)
+    node->readerror = errno;
+
+  dirreader_close(cd);
+
+  stats_add(&stats.entries, entries);
+  stats_add(&stats.metadatacalls, metadatacalls);
+}
+
+void *scanworker(void *arg)
+{
+  struct scanqueue *queue = arg;
+  struct scannode *node;
+
+  pthread_mutex_lock(&queue->mutex);
+
+  for (;;) {
+    while (queue->pending == 0 && queue->scanning > 0 && !got_sigint)
+      pthread_cond_wait(&queue->changed, &queue->mutex);
+
+    if (queue->pending == 0 || got_sigint)
+      break;
+
+    node = queue->pending;
+    queue->pending = node->nextpending;
+    ++queue->scanning;
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    scannode(queue, node);
+
+    pthread_mutex_lock(&queue->mutex);
+
+    --queue->scanning;
+  }
+
+  --queue->running;
+  pthread_cond_broadcast(&queue->changed);
+
+  pthread_mutex_unlock(&queue->mutex);
+
+  return 0;
+}
+
+/* Add the files found in a scanned directory tree to the file list,
+   in the same order and with the same cache updates as grokdir(). */
+int collectscan(struct scannode *node, file_t **filelistp)
+{
+  struct scanitem *item;
+  int filecount = 0;
+  int filesadded;
+  size_t i;
+#ifndef NO_SQLITE
+  sqlite3_int64 pathid = 0;
+  struct hashdb_preload preload = { 0, 0 };
+#endif
+
+  if (node->failed) {
+    errormsg("could not chdir to %s\n", node->path);
+    free(node);
+    return 0;
+  }
+
+  if (node->readerror != 0)
+    errormsg("could not read all of %s: %s\n", node->path, strerror(node->readerror));
+
+#ifndef NO_SQLITE
+  delist_missing_within(node->directory, &pathid);
+
+  if (db != 0)
+    hashdb_preloaddirectory(db, node->directory, &preload);
+#endif
+
+  for (i = 0; i < node->count; ++i) {
+    item = &node->items[i];
+
+    if (item->subdirectory != 0) {
+      filesadded = collectscan(item->subdirectory, filelistp);
+      filecount += filesadded;
+
+#ifndef NO_SQLITE
+      if (db != 0 && pathid == 0 && !ISFLAG(flags, F_READONLYCACHE) && filesadded > 0 && node->directory->realpath != 0) {
+        hashdb_savedirectory(db, node->directory->realpath);
+        node->directory->cacheid = DIRECTORY_ID_UNKNOWN;
+      }
+#endif
+
+      free(item->file->d_name);
+      free(item->file);
+    } else {
+#ifndef NO_SQLITE
+      hashdb_applypreload(&preload, item->file);
+#endif
+
+      item->file->next = *filelistp;
+      *filelistp = item->file;
+      filecount++;
+    }
+  }
+
+#ifndef NO_SQLITE
+  hashdb_freepreload(&preload);
+#endif
+
+  free(node->items);
+  free(node);
+
+  return filecount;
+}
+
+/* Equivalent to grokdir(), but reads directories on a pool of threads. */
+int scandirectory(char *dir, file_t **filelistp, struct stat *logfile_status)
+{
+  struct scanqueue queue;
+  struct scannode *root;
+  struct timespec deadline;
+  pthread_t *workers;
+  int started;
+  int t;
+
+  root = newscannode(dir, 0, 0);
+
+  queue.pending = root;
+  queue.scanning = 0;
+  queue.running = 0;
+  queue.logfile_status = logfile_status;
+
+  pthread_mutex_init(&queue.mutex, 0);
+  pthread_cond_init(&queue.changed, 0);
+
+  workers = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+  if (workers == 0) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  pthread_mutex_lock(&queue.mutex);
+
+  started = 0;
+  for (t = 0; t < threads; ++t) {
+    if (pthread_create(&workers[started], 0, scanworker, &queue) != 0)
+      break;
+
+    ++started;
+    ++queue.running;
+  }
+
+  pthread_mutex_unlock(&queue.mutex);
+
+  /* no threads could be started; scan from this thread instead */
+  if (started == 0) {
+    ++queue.running;
+    scanworker(&queue);
+  }
+
+  pthread_mutex_lock(&queue.mutex);
+
+  while (queue.running > 0) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += FDUPES_PROGRESS_REFRESH_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_cond_timedwait(&queue.changed, &queue.mutex, &deadline);
+
+    showbuildprogress();
+  }
+
+  pthread_mutex_unlock(&queue.mutex);
+
+  for (t = 0; t < started; ++t)
+    pthread_join(workers[t], 0);
+
+  free(workers);
+
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.mutex);
+
+  if (got_sigint) {
+    printf("\n");
+    exit(0);
+  }
+
+  return collectscan(root, filelistp);
+}
+#endif
+
+#define SIGNATURE_OK 0
+#define SIGNATURE_OPEN_FAILED -1
+#define SIGNATURE_READ_FAILED -2
+#define SIGNATURE_INTERRUPTED -3
+
+/* Compute the digest of the first max_read bytes of a file (or the
+   whole file if max_read is 0). Safe to call from several threads at
+   once, as each call reads through its own buffer. */
+int computesignature(char *filename, off_t fsize, off_t max_read, md5_byte_t *digest)
+{
+  off_t toread;
+  struct hashstate state;
+  md5_byte_t chunk[CHUNK_SIZE];
+  unsigned long long bytesread = 0;
+  FILE *file;
+
+  if (max_read != 0 && fsize > max_read)
+    fsize = max_read;
+
+  file = fopen(filename, "rb");
+  if (file == NULL)
+    return SIGNATURE_OPEN_FAILED;
+
+  stats_add(&stats.opens, 1);
+
+#ifdef HAVE_MMAP_IO
+  if (iomode == IO_MMAP) {
+    hash_init(&state);
+    if (mmapio_hash(fileno(file), fsize, &state) == 0) {
+      hash_finish(&state, digest);
+      fclose(file);
+      stats_add(&stats.bytesread, fsize);
+      return SIGNATURE_OK;
+    }
+    hash_finish(&state, chunk);
+
+    if (got_sigint) {
+      fclose(file);
+      return SIGNATURE_INTERRUPTED;
+    }
+
+    /* could not map the file; read it instead */
+  }
+#endif
+
+  hash_init(&state);
+
+  while (fsize > 0) {
+    if (got_sigint) {
+      hash_finish(&state, chunk);
+      fclose(file);
+      stats_add(&stats.bytesread, bytesread);
+      return SIGNATURE_INTERRUPTED;
+    }
+
+    toread = (fsize >= CHUNK_SIZE) ? CHUNK_SIZE : fsize;
+    if (fread(chunk, toread, 1, file) != 1) {
+      hash_finish(&state, chunk);
+      fclose(file);
+      stats_add(&stats.bytesread, bytesread);
+      return SIGNATURE_READ_FAILED;
+    }
+    hash_update(&state, chunk, toread);
+    bytesread += toread;
+    fsize -= toread;
+  }
+
+  hash_finish(&state, digest);
+
+  fclose(file);
+
+  stats_add(&stats.bytesread, bytesread);
+
+  return SIGNATURE_OK;
+}
+
+/* Compute the digest of the blocks an intermediate matching stage reads
+   from a file. Safe to call from several threads at once. */
+int computestagesignature(char *filename, off_t fsize, const struct stage *stage, md5_byte_t *digest)
+{
+  struct hashstate state;
+  md5_byte_t chunk[PARTIAL_MD5_SIZE];
+  off_t offsets[STAGE_MAX_SAMPLES];
+  size_t blocks;
+  size_t b;
+  FILE *file;
+
+  file = fopen(filename, "rb");
+  if (file == NULL)
+    return SIGNATURE_OPEN_FAILED;
+
+  stats_add(&stats.opens, 1);
+
+  blocks = stageblocks(stage, fsize, offsets);
+
+  hash_init(&state);
+
+  for (b = 0; b < blocks; ++b) {
+    if (fseeko(file, offsets[b], SEEK_SET) != 0 || fread(chunk, PARTIAL_MD5_SIZE, 1, file) != 1) {
+      hash_finish(&state, chunk);
+      fclose(file);
+      stats_add(&stats.bytesread, b * PARTIAL_MD5_SIZE);
+      return SIGNATURE_READ_FAILED;
+    }
+
+    hash_update(&state, chunk, PARTIAL_MD5_SIZE);
+  }
+
+  hash_finish(&state, digest);
+
+  fclose(file);
+
+  stats_add(&stats.bytesread, blocks * PARTIAL_MD5_SIZE);
+
+  return SIGNATURE_OK;
+}
+
+int getcrcsignatureuntil(char *filename, off_t fsize, off_t max_read, md5_byte_t *digest)
+{
+  switch (computesignature(filename, fsize, max_read, digest))
+  {
+  case SIGNATURE_OK:
+    return 1;
+
+  case SIGNATURE_OPEN_FAILED:
+    errormsg("error opening file %s\n", filename);
+    break;
+
+  case SIGNATURE_READ_FAILED:
+    errormsg("error reading from file %s\n", filename);
+    break;
+
+  case SIGNATURE_INTERRUPTED:
+    printf("\n");
+    exit(0);
+  }
+
+  return 0;
+}
+
+/* Fill in a file's full signature. Returns 0 on failure. */
+int getcrcsignature(file_t *file)
+{
+  if (!getcrcsignatureuntil(file->d_name, file->size, 0, file->crcsignature))
+    return 0;
+
+  file->hashes |= HAS_SIGNATURE;
+  return 1;
+}
+
+/* Fill in a file's partial signature. Returns 0 on failure. */
+int getcrcpartialsignature(file_t *file)
+{
+  if (!getcrcsignatureuntil(file->d_name, file->size, PARTIAL_MD5_SIZE, file->crcpartial))
+    return 0;
+
+  file->hashes |= HAS_PARTIAL;
+  return 1;
+}
+
+int md5cmp(const md5_byte_t *a, const md5_byte_t *b)
+{
+  int x;
+
+  for (x = 0; x < HASH_DIGEST_LENGTH; ++x)
+  {
+    if (a[x] < b[x])
+      return -1;
+    else if (a[x] > b[x])
+      return 1;
+  }
+
+  return 0;
+}
+
+void md5copy(md5_byte_t *to, const md5_byte_t *from)
+{
+  int x;
+
+  for (x = 0; x < HASH_DIGEST_LENGTH; ++x)
+    to[x] = from[x];
+}
+
+/* whether checkmatch() compares full signatures; see needfullsignatures() */
+int fullsignatures = 1;
+
+/* Matches between the only two files of a given size are settled by a
+   single byte-by-byte comparison, which stops at the first difference,
+   so full signatures are only needed for larger sets, or when they are
+   wanted for the cache, the JSON output or matches are not confirmed
+   byte by byte (as with --dedupe, which leaves that to the kernel). */
+int needfullsignatures(size_t bucketsize)
+{
+  return bucketsize > 2 ||
+    outputformat == FORMAT_JSON || outputformat == FORMAT_NDJSON ||
+    (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE)) ||
+    ISFLAG(flags, F_DEFERCONFIRMATION) ||
+    ISFLAG(flags, F_QUICKSUMMARY) ||
+    ISFLAG(flags, F_DEDUPEFILES);
+}
+
+#define HASHJOB_PARTIAL 0
+#define HASHJOB_FULL 1
+#define HASHJOB_STAGE 2 /* plus the index of the intermediate stage */
+
+/* fill in one of a file's signatures; may run on a worker thread */
+void hashjob(void *item, void *context)
+{
+  file_t *file = (file_t*) item;
+  int kind = *(int*) context;
+  md5_byte_t *digest;
+  int result;
+
+  /* on failure, leave the signature empty; checkmatch() will try
+     again on the main thread and report the error there */
+  if (kind == HASHJOB_PARTIAL) {
+    if (computesignature(file->d_name, file->size, PARTIAL_MD5_SIZE, file->crcpartial) == SIGNATURE_OK)
+      file->hashes |= HAS_PARTIAL;
+    return;
+  }
+
+  if (kind == HASHJOB_FULL) {
+    if (computesignature(file->d_name, file->size, 0, file->crcsignature) == SIGNATURE_OK)
+      file->hashes |= HAS_SIGNATURE;
+    return;
+  }
+
+  digest = (md5_byte_t*) malloc(HASH_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (digest == NULL)
+    return;
+
+  result = computestagesignature(file->d_name, file->size, &stages[kind - HASHJOB_STAGE], digest);
+  if (result != SIGNATURE_OK)
+  {
+    free(digest);
+    return;
+  }
+
+  file->crcstages[kind - HASHJOB_STAGE] = digest;
+}
+
+void hashprogress(size_t done, size_t total)
+{
+  static uint64_t last_progress = 0;
+  uint64_t now;
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    now = now64();
+    if ( now - last_progress > FDUPES_PROGRESS_REFRESH_MS ) {
+      last_progress = now;
+      fprintf(stderr, "\rHashing [%lu/%lu] %d%% ", (unsigned long) done, (unsigned long) total,
+        (int)((float) done / (float) total * 100.0));
+    }
+  }
+}
+
+/* Compare two files of the same size by their partial signature and
+   the signatures of the first level intermediate stages. */
+int comparesignatures(const file_t *a, const file_t *b, int level)
+{
+  int cmpresult;
+  int s;
+
+  cmpresult = md5cmp(a->crcpartial, b->crcpartial);
+
+  for (s = 0; cmpresult == 0 && s < level; ++s)
+    if (stageapplies(&stages[s], a->size))
+      cmpresult = md5cmp(a->crcstages[s], b->crcstages[s]);
+
+  return cmpresult;
+}
+
+/* whether a file has every signature comparesignatures() needs */
+int hassignatures(const file_t *file, int level)
+{
+  int s;
+
+  if (!HASPARTIAL(file))
+    return 0;
+
+  for (s = 0; s < level; ++s)
+    if (stageapplies(&stages[s], file->size) && file->crcstages[s] == NULL)
+      return 0;
+
+  return 1;
+}
+
+static int sortlevel;
+
+int sort_by_signatures(const void *a, const void *b)
+{
+  return comparesignatures(*(file_t**) a, *(file_t**) b, sortlevel);
+}
+
+#ifdef HAVE_IO_URING
+/* Run hash jobs through io_uring. Returns 0 if io_uring is unavailable. */
+int runhashjobs_uring(file_t **jobs, size_t count, int kind)
+{
+  md5_byte_t **digests;
+  size_t j;
+
+  digests = (md5_byte_t**) malloc(sizeof(md5_byte_t*) * count);
+  if (digests == NULL)
+    return 0;
+
+  for (j = 0; j < count; ++j)
+    digests[j] = kind == HASHJOB_PARTIAL ? jobs[j]->crcpartial : jobs[j]->crcsignature;
+
+  if (!uringsignatures(jobs, count, kind == HASHJOB_PARTIAL ? PARTIAL_MD5_SIZE : 0, devicedepth, digests, hashprogress)) {
+    free(digests);
+    return 0;
+  }
+
+  for (j = 0; j < count; ++j)
+    if (digests[j] != NULL)
+      jobs[j]->hashes |= kind == HASHJOB_PARTIAL ? HAS_PARTIAL : HAS_SIGNATURE;
+
+  free(digests);
+
+  return 1;
+}
+#endif
+
+#ifndef NO_SQLITE
+/* Fill in a file's cached signatures, if any. Those cached under another
+   path to the file, as before a rename or move, are saved under its
+   current path too, so that pruning the old path does not lose them. */
+void loadcachedhash(file_t *file)
+{
+  if (hashdb_loadhash(db, file) == HASHDB_FOUND_ELSEWHERE && !ISFLAG(flags, F_READONLYCACHE))
+    hashdb_savehash(db, file);
+}
+#endif
+
+void runhashjobs(file_t **jobs, size_t count, int kind)
+{
+  size_t j;
+  int finished = 0;
+
+  if (count == 0)
+    return;
+
+  sortbylocation(jobs, count);
+
+#ifdef HAVE_IO_URING
+  if (iomode == IO_URING && kind < HASHJOB_STAGE)
+    finished = runhashjobs_uring(jobs, count, kind);
+#endif
+
+#ifndef NO_THREADS
+  if (!finished && threads > 1) {
+    unsigned long long *devices = NULL;
+
+    if (devicedepth > 0) {
+      devices = (unsigned long long*) malloc(sizeof(unsigned long long) * count);
+      if (devices == NULL) {
+        errormsg("out of memory!\n");
+        exit(1);
+      }
+
+      for (j = 0; j < count; ++j)
+        devices[j] = jobs[j]->device;
+    }
+
+    workqueue_run((void**) jobs, count, threads, devices, devicedepth, hashjob, &kind, hashprogress);
+    free(devices);
+    finished = 1;
+  }
+#endif
+
+  for (j = 0; !finished && j < count && !got_sigint; ++j) {
+    hashjob(jobs[j], &kind);
+    hashprogress(j + 1, count);
+  }
+
+  if (got_sigint) {
+    printf("\n");
+    exit(0);
+  }
+
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE)) {
+    for (j = 0; j < count; ++j) {
+      if (kind >= HASHJOB_STAGE) {
+        if (jobs[j]->crcstages[kind - HASHJOB_STAGE] != NULL)
+          hashdb_savestage(db, jobs[j], stages[kind - HASHJOB_STAGE].kind, stages[kind - HASHJOB_STAGE].samples, jobs[j]->crcstages[kind - HASHJOB_STAGE]);
+      }
+      else if (jobs[j]->hashes & (kind == HASHJOB_PARTIAL ? HAS_PARTIAL : HAS_SIGNATURE))
+        hashdb_savehash(db, jobs[j]);
+    }
+  }
+#endif
+}
+
+/* Whether files may borrow full signatures; see borrowsignatures(). Only
+   chains of duplicates confirmed as a whole, by confirmchain(), settle
+   borrowed signatures, and only cached signatures are worth borrowing:
+   without the cache, full signatures are computed all at once. */
+int canborrowsignatures()
+{
+  return ISFLAG(flags, F_CACHESIGNATURES) &&
+    !ISFLAG(flags, F_DEFERCONFIRMATION) &&
+    !ISFLAG(flags, F_QUICKSUMMARY) &&
+    !ISFLAG(flags, F_DEDUPEFILES) &&
+    !(ISFLAG(flags, F_DELETEFILES) && ISFLAG(flags, F_IMMEDIATE));
+}
+
+/* Give the files of a run, files that share their size and every
+   signature short of the full one, that lack a full signature the one
+   all others in the run have, typically cached from an earlier run, so
+   that they are read only once, to be compared with those others. Any
+   duplicates they have are in the run, so one that turns out to differ
+   when its chain is confirmed can only match other borrowers, which are
+   compared with it at the same time. Runs too large to be compared in
+   one pass are left alone. */
+void borrowsignatures(file_t **run, size_t count)
+{
+  file_t *lender = NULL;
+  size_t f;
+
+  if (count > GROUP_MAX_FILES)
+    return;
+
+  for (f = 0; f < count; ++f) {
+    if (!HASSIGNATURE(run[f]))
+      continue;
+
+    if (lender == NULL)
+      lender = run[f];
+    else if (md5cmp(run[f]->crcsignature, lender->crcsignature) != 0)
+      return;
+  }
+
+  if (lender == NULL)
+    return;
+
+  for (f = 0; f < count; ++f) {
+    if (!HASSIGNATURE(run[f])) {
+      md5copy(run[f]->crcsignature, lender->crcsignature);
+      run[f]->hashes |= HAS_SIGNATURE | SIGNATURE_BORROWED;
+      ++stats.borrowed;
+    }
+  }
+}
+
+/* Compute in bulk, using worker threads or io_uring, every signature
+   checkmatch() would otherwise compute one file at a time: partial
+   signatures for all files that share their size with another file,
+   then each intermediate stage's signatures for the files that share
+   every earlier signature, and finally full signatures. Files in
+   sizeorder must be grouped by size. */
+void precomputesignatures(file_t **sizeorder, size_t count)
+{
+  file_t **jobs;
+  file_t **bucket;
+  size_t jobcount;
+  size_t start;
+  size_t end;
+  size_t run;
+  size_t f;
+  size_t n;
+  int level;
+
+  jobs = (file_t**) malloc(sizeof(file_t*) * count);
+  bucket = (file_t**) malloc(sizeof(file_t*) * count);
+  if (jobs == NULL || bucket == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  jobcount = 0;
+  for (start = 0; start < count; start = end) {
+    for (end = start + 1; end < count && sizeorder[end]->size == sizeorder[start]->size; ++end);
+
+    if (end - start == 1)
+      continue;
+
+    for (f = start; f < end; ++f) {
+      if (HASPARTIAL(sizeorder[f]))
+        continue;
+
+#ifndef NO_SQLITE
+      if (ISFLAG(flags, F_CACHESIGNATURES))
+        loadcachedhash(sizeorder[f]);
+#endif
+
+      if (!HASPARTIAL(sizeorder[f]))
+        jobs[jobcount++] = sizeorder[f];
+    }
+  }
+
+  runhashjobs(jobs, jobcount, HASHJOB_PARTIAL);
+
+  for (level = 0; level <= stagecount; ++level) {
+    jobcount = 0;
+    for (start = 0; start < count; start = end) {
+      for (end = start + 1; end < count && sizeorder[end]->size == sizeorder[start]->size; ++end);
+
+      if (level < stagecount && !stageapplies(&stages[level], sizeorder[start]->size))
+        continue;
 
-  closedir(cd);
+      if (level == stagecount && !needfullsignatures(end - start))
+        continue;
 
-  return filecount;
-}
+      n = 0;
+      for (f = start; f < end; ++f)
+        if (hassignatures(sizeorder[f], level))
+          bucket[n++] = sizeorder[f];
 
-md5_byte_t *getcrcsignatureuntil(char *filename, off_t fsize, off_t max_read)
-{
-  off_t toread;
-  md5_state_t state;
-  md5_byte_t *digest;
-  static md5_byte_t chunk[CHUNK_SIZE];
-  FILE *file;
+      if (n < 2)
+        continue;
 
-  digest = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
-  if (digest == NULL) {
-    errormsg("out of memory\n");
-    exit(1);
-  }
+      sortlevel = level;
+      qsort(bucket, n, sizeof(file_t*), sort_by_signatures);
 
-  md5_init(&state);
+      for (f = 0; f < n; f = run) {
+        for (run = f + 1; run < n && comparesignatures(bucket[run], bucket[f], level) == 0; ++run);
 
-  if (max_read != 0 && fsize > max_read)
-    fsize = max_read;
+        if (run - f == 1)
+          continue;
 
-  file = fopen(filename, "rb");
-  if (file == NULL) {
-    errormsg("error opening file %s\n", filename);
-    return NULL;
-  }
+        if (level == stagecount && canborrowsignatures())
+          borrowsignatures(bucket + f, run - f);
 
-  while (fsize > 0) {
-    if (got_sigint) {
-      fclose(file);
-      printf("\n");
-      exit(0);
-    }
+        for (; f < run; ++f) {
+          if (level == stagecount) {
+            if (!HASSIGNATURE(bucket[f]))
+              jobs[jobcount++] = bucket[f];
+            continue;
+          }
 
-    toread = (fsize >= CHUNK_SIZE) ? CHUNK_SIZE : fsize;
-    if (fread(chunk, toread, 1, file) != 1) {
-      errormsg("error reading from file %s\n", filename);
-      fclose(file);
-      return NULL;
-    }
-    md5_append(&state, chunk, toread);
-    fsize -= toread;
-  }
+          if (bucket[f]->crcstages[level] != NULL)
+            continue;
 
-  md5_finish(&state, digest);
+#ifndef NO_SQLITE
+          if (ISFLAG(flags, F_CACHESIGNATURES))
+            hashdb_loadstage(db, bucket[f], stages[level].kind, stages[level].samples, &bucket[f]->crcstages[level]);
+#endif
 
-  fclose(file);
+          if (bucket[f]->crcstages[level] == NULL)
+            jobs[jobcount++] = bucket[f];
+        }
+      }
+    }
 
-  return digest;
-}
+    runhashjobs(jobs, jobcount, level == stagecount ? HASHJOB_FULL : HASHJOB_STAGE + level);
+  }
 
-md5_byte_t *getcrcsignature(char *filename, off_t fsize)
-{
-  return getcrcsignatureuntil(filename, fsize, 0);
+  free(bucket);
+  free(jobs);
 }
 
-md5_byte_t *getcrcpartialsignature(char *filename, off_t fsize)
-{
-  return getcrcsignatureuntil(filename, fsize, PARTIAL_MD5_SIZE);
-}
+/* With --stream, signatures are computed in bulk for a run of whole
+   sizes at a time, until it holds STREAM_BATCH_FILES files that share
+   their size with another, or STREAM_BATCH_BYTES of them, so that the
+   sets of one run are listed while the next is yet to be hashed. */
+#define STREAM_BATCH_FILES 4096
+#define STREAM_BATCH_BYTES ((off_t) 1 << 30)
 
-int md5cmp(const md5_byte_t *a, const md5_byte_t *b)
+/* Return the end of the run of sizes in sizeorder starting at start. */
+size_t streambatchend(file_t **sizeorder, size_t count, size_t start)
 {
-  int x;
+  size_t files = 0;
+  off_t bytes = 0;
+  size_t end;
 
-  for (x = 0; x < MD5_DIGEST_LENGTH; ++x)
-  {
-    if (a[x] < b[x])
-      return -1;
-    else if (a[x] > b[x])
-      return 1;
-  }
+  while (start < count && files < STREAM_BATCH_FILES && bytes < STREAM_BATCH_BYTES) {
+    for (end = start + 1; end < count && sizeorder[end]->size == sizeorder[start]->size; ++end);
 
-  return 0;
-}
+    if (end - start > 1) {
+      files += end - start;
+      bytes += sizeorder[start]->size * (off_t) (end - start);
+    }
 
-void md5copy(md5_byte_t *to, const md5_byte_t *from)
-{
-  int x;
+    start = end;
+  }
 
-  for (x = 0; x < MD5_DIGEST_LENGTH; ++x)
-    to[x] = from[x];
+  return start;
 }
 
 void purgetree(filetree_t *checktree)
@@ -695,9 +1910,67 @@ int has_same_file(filetree_t *checktree, file_t *file)
   return 0;
 }
 
+/* Make sure a file's signature for intermediate stage s is available,
+   loading it from the cache or computing it. Returns 0 on failure. */
+int getstagesignature(file_t *file, int s)
+{
+  md5_byte_t *digest;
+
+  if (file->crcstages[s] != NULL)
+    return 1;
+
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_CACHESIGNATURES) && hashdb_loadstage(db, file, stages[s].kind, stages[s].samples, &file->crcstages[s]))
+    return 1;
+#endif
+
+  digest = (md5_byte_t*) malloc(HASH_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (digest == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  switch (computestagesignature(file->d_name, file->size, &stages[s], digest))
+  {
+  case SIGNATURE_OK:
+    break;
+
+  case SIGNATURE_OPEN_FAILED:
+    errormsg("error opening file %s\n", file->d_name);
+    free(digest);
+    return 0;
+
+  default:
+    errormsg("error reading from file %s\n", file->d_name);
+    free(digest);
+    return 0;
+  }
+
+  file->crcstages[s] = digest;
+
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
+    hashdb_savestage(db, file, stages[s].kind, stages[s].samples, digest);
+#endif
+
+  return 1;
+}
+
+/* count each file once for every matching stage it reaches (0 for the
+   partial signature, then the intermediate stages, then the full
+   signature), for --stats */
+void markstage(file_t *file, int n)
+{
+  if (!(file->stagesreached & (1 << n))) {
+    file->stagesreached |= 1 << n;
+    ++stats.stagefiles[n];
+  }
+}
+
 file_t **checkmatch(filetree_t **root, filetree_t *checktree, file_t *file)
 {
   int cmpresult;
+  int s;
   char *fullpath;
 
   if (ISFLAG(flags, F_CONSIDERHARDLINKS))
@@ -727,68 +2000,83 @@ file_t **checkmatch(filetree_t **root, filetree_t *checktree, file_t *file)
         !same_permissions(file->d_name, checktree->file->d_name))
         cmpresult = -1;
   else {
-    if (checktree->file->crcpartial == NULL) {
+    if (!HASPARTIAL(checktree->file)) {
 #ifndef NO_SQLITE
       if (ISFLAG(flags, F_CACHESIGNATURES))
-        hashdb_loadhash(db, checktree->file, &checktree->file->crcpartial, &checktree->file->crcsignature);
+        loadcachedhash(checktree->file);
 #endif
 
-      if (checktree->file->crcpartial == NULL)
+      if (!HASPARTIAL(checktree->file))
       {
-        checktree->file->crcpartial = getcrcpartialsignature(checktree->file->d_name, checktree->file->size);
-        if (checktree->file->crcpartial == NULL) {
+        if (!getcrcpartialsignature(checktree->file)) {
           errormsg ("cannot read file %s\n", checktree->file->d_name);
           return NULL;
         }
 
 #ifndef NO_SQLITE
         if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, checktree->file, checktree->file->crcpartial, checktree->file->crcsignature);
+          hashdb_savehash(db, checktree->file);
 #endif
       }
     }
 
-    if (file->crcpartial == NULL) {
+    if (!HASPARTIAL(file)) {
 #ifndef NO_SQLITE
       if (ISFLAG(flags, F_CACHESIGNATURES))
-        hashdb_loadhash(db, file, &file->crcpartial, &file->crcsignature);
+        loadcachedhash(file);
 #endif
 
-      if (file->crcpartial == NULL)
+      if (!HASPARTIAL(file))
       {
-        file->crcpartial = getcrcpartialsignature(file->d_name, file->size);
-        if (file->crcpartial == NULL) {
+        if (!getcrcpartialsignature(file)) {
           errormsg ("cannot read file %s\n", file->d_name);
           return NULL;
         }
 
 #ifndef NO_SQLITE
         if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, file, file->crcpartial, file->crcsignature);
+          hashdb_savehash(db, file);
 #endif
       }
     }
 
+    markstage(file, 0);
+    markstage(checktree->file, 0);
+
     cmpresult = md5cmp(file->crcpartial, checktree->file->crcpartial);
 
-    if (cmpresult == 0) {
-      if (checktree->file->crcsignature == NULL) {
-        checktree->file->crcsignature = getcrcsignature(checktree->file->d_name, checktree->file->size);
-        if (checktree->file->crcsignature == NULL)
+    for (s = 0; cmpresult == 0 && s < stagecount; ++s) {
+      markstage(file, s + 1);
+      markstage(checktree->file, s + 1);
+
+      if (!stageapplies(&stages[s], file->size))
+        continue;
+
+      if (!getstagesignature(checktree->file, s) || !getstagesignature(file, s))
+        return NULL;
+
+      cmpresult = md5cmp(file->crcstages[s], checktree->file->crcstages[s]);
+    }
+
+    if (cmpresult == 0 && fullsignatures) {
+      markstage(file, stagecount + 1);
+      markstage(checktree->file, stagecount + 1);
+
+      if (!HASSIGNATURE(checktree->file)) {
+        if (!getcrcsignature(checktree->file))
           return NULL;
 #ifndef NO_SQLITE
         if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, checktree->file, checktree->file->crcpartial, checktree->file->crcsignature);
+          hashdb_savehash(db, checktree->file);
 #endif
       }
 
-      if (file->crcsignature == NULL) {
-        file->crcsignature = getcrcsignature(file->d_name, file->size);
-        if (file->crcsignature == NULL)
+      if (!HASSIGNATURE(file)) {
+        if (!getcrcsignature(file))
           return NULL;
 #ifndef NO_SQLITE
         if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, file, file->crcpartial, file->crcsignature);
+          hashdb_savehash(db, file);
 #endif
       }
 
@@ -854,92 +2142,447 @@ void summarizematches(file_t *files)
   }
 }
 
-void printmatches(file_t *files)
+void printmatchset(file_t *files)
 {
   file_t *tmpfile;
 
+  if (!ISFLAG(flags, F_OMITFIRST)) {
+    if (ISFLAG(flags, F_SHOWSIZE)) printf("%lld byte%seach:\n", (long long int)files->size,
+     (files->size != 1) ? "s " : " ");
+    if (ISFLAG(flags, F_SHOWTIME))
+      printf("%s ", fmttime(files->mtime));
+    if (ISFLAG(flags, F_DSAMELINE)) escapefilename("\\ ", &files->d_name);
+    printf("%s%c", files->d_name, ISFLAG(flags, F_DSAMELINE)?' ':'\n');
+  }
+  tmpfile = files->duplicates;
+  while (tmpfile != NULL) {
+    if (ISFLAG(flags, F_SHOWTIME))
+      printf("%s ", fmttime(tmpfile->mtime));
+    if (ISFLAG(flags, F_DSAMELINE)) escapefilename("\\ ", &tmpfile->d_name);
+    printf("%s%c", tmpfile->d_name, ISFLAG(flags, F_DSAMELINE)?' ':'\n');
+    tmpfile = tmpfile->duplicates;
+  }
+  printf("\n");
+}
+
+void printmatches(file_t *files)
+{
   while (files != NULL) {
-    if (files->hasdupes) {
-      if (!ISFLAG(flags, F_OMITFIRST)) {
-	if (ISFLAG(flags, F_SHOWSIZE)) printf("%lld byte%seach:\n", (long long int)files->size,
-	 (files->size != 1) ? "s " : " ");
-        if (ISFLAG(flags, F_SHOWTIME))
-          printf("%s ", fmttime(files->mtime));
-	if (ISFLAG(flags, F_DSAMELINE)) escapefilename("\\ ", &files->d_name);
-	printf("%s%c", files->d_name, ISFLAG(flags, F_DSAMELINE)?' ':'\n');
+    if (files->hasdupes)
+      printmatchset(files);
+
+    files = files->next;
+  }
+}
+
+/* With --stream, list the sets of duplicates found among files of one
+   size as soon as that size is done. */
+void streammatches(file_t **bucket, size_t count)
+{
+  size_t i;
+  int found = 0;
+
+  for (i = 0; i < count; ++i) {
+    if (!bucket[i]->hasdupes)
+      continue;
+
+    if (outputformat != FORMAT_TEXT)
+      matchwriter_set(bucket[i]);
+    else
+      printmatchset(bucket[i]);
+
+    found = 1;
+  }
+
+  if (found && outputformat == FORMAT_TEXT)
+    fflush(stdout);
+}
+
+/* List duplicates in a machine-readable --format. */
+void writematches(file_t *files)
+{
+  matchwriter_begin(stdout);
+
+  for (; files != NULL; files = files->next)
+    if (files->hasdupes)
+      matchwriter_set(files);
+
+  matchwriter_end();
+}
+
+#define REVISE_APPEND "_tmp"
+/* Derive a name for a temporary file next to path, inserting
+   REVISE_APPEND and seq before its extension. */
+char *revisefilename(char *path, int seq)
+{
+  int digits;
+  char *newpath;
+  char *scratch;
+  char *dot;
+  char *slash;
+
+  digits = snprintf(0, 0, "%d", seq);
+  newpath = malloc(strlen(path) + strlen(REVISE_APPEND) + digits + 1);
+  if (!newpath) return newpath;
+
+  scratch = malloc(strlen(path) + 1);
+  if (!scratch) {
+    free(newpath);
+    return 0;
+  }
+
+  strcpy(scratch, path);
+  dot = strrchr(scratch, '.');
+  slash = strrchr(scratch, '/');
+  if (dot && (slash == 0 || dot > slash + 1))
+  {
+    *dot = 0;
+    sprintf(newpath, "%s%s%d.%s", scratch, REVISE_APPEND, seq, dot + 1);
+  }
+
+  else
+  {
+    sprintf(newpath, "%s%s%d", path, REVISE_APPEND, seq);
+  }
+
+  free(scratch);
+
+  return newpath;
+}
+
+/* Create newfile as a hard link to oldfile. Returns 1 on success, 0 if
+   the link could not be created (see errno), and -1 if newfile turns
+   out not to be the link just created. */
+int relink(char *oldfile, char *newfile)
+{
+  dev_t od;
+  dev_t nd;
+  ino_t oi;
+  ino_t ni;
+
+  od = getdevice(oldfile);
+  oi = getinode(oldfile);
+
+  if (link(oldfile, newfile) != 0)
+    return 0;
+
+  /* make sure we're working with the right file (the one we created) */
+  nd = getdevice(newfile);
+  ni = getinode(newfile);
+
+  if (nd != od || oi != ni)
+    return -1; /* file is not what we expected */
+
+  return 1;
+}
+
+/* a duplicate to be replaced with a hard link to the file kept */
+struct linkjob
+{
+  file_t *keep;
+  file_t *file;
+  char *directory;
+  char *temporary;
+  char *errorstring;
+  int linked;
+};
+
+int sort_linkjobs_by_directory(const void *a, const void *b)
+{
+  const struct linkjob *ja = *(struct linkjob**) a;
+  const struct linkjob *jb = *(struct linkjob**) b;
+  int result;
+
+  result = strcmp(ja->directory, jb->directory);
+  if (result != 0)
+    return result;
+
+  return ja < jb ? -1 : ja > jb;
+}
+
+/* Hard link a duplicate under a temporary name next to it. */
+void linkjob_prepare(struct linkjob *job)
+{
+  static char *crossdevice = "Files are on different file systems";
+  static char *unexpected = "Temporary link is not the file expected";
+  static char *outofmemory = "Out of memory";
+  struct stat keep;
+  int result;
+  int seq;
+
+  if (job->file->device != job->keep->device) {
+    job->errorstring = crossdevice;
+    return;
+  }
+
+  /* with -H the duplicate may already be a link to the file kept */
+  if (job->file->inode == job->keep->inode) {
+    job->linked = 1;
+    return;
+  }
+
+  /* the file kept may already have gained links (and a new ctime) from
+     earlier jobs, so only check that its contents look unchanged */
+  if (filechanged(job->file) || stat(job->keep->d_name, &keep) != 0 ||
+      keep.st_dev != job->keep->device || keep.st_ino != job->keep->inode ||
+      keep.st_size != job->keep->size || keep.st_mtime != job->keep->mtime) {
+    job->errorstring = FILE_CHANGED_ERROR;
+    return;
+  }
+
+  for (seq = 0; ; ++seq) {
+    job->temporary = revisefilename(job->file->d_name, seq);
+    if (job->temporary == 0) {
+      job->errorstring = outofmemory;
+      return;
+    }
+
+    errno = 0;
+    result = relink(job->keep->d_name, job->temporary);
+    if (result == 1)
+      return;
+
+    if (result == 0 && errno == EEXIST) {
+      free(job->temporary);
+      continue;
+    }
+
+    job->errorstring = result == 0 ? strerror(errno) : unexpected;
+
+    free(job->temporary);
+    job->temporary = 0;
+
+    return;
+  }
+}
+
+/* Replace each duplicate with a hard link to the first file in its set.
+   Each link is made under a temporary name and renamed over the
+   duplicate, so that the duplicate's path always names one of the two
+   files. Renames are done directory by directory, syncing each
+   directory once its renames are done. */
+void linkfiles(file_t *files, char *logfile)
+{
+  struct linkjob *jobs;
+  struct linkjob **bydirectory;
+  struct log_info *loginfo;
+  file_t *curfile;
+  file_t *tmpfile;
+  size_t jobcount;
+  size_t first;
+  size_t last;
+  size_t j;
+  struct stat info;
+  int log_error;
+  int fd;
+#ifndef NO_SQLITE
+  char *linkpath;
+#endif
+
+  jobcount = 0;
+  for (curfile = files; curfile; curfile = curfile->next)
+    if (curfile->hasdupes)
+      for (tmpfile = curfile->duplicates; tmpfile; tmpfile = tmpfile->duplicates)
+        ++jobcount;
+
+  jobs = (struct linkjob*) malloc(sizeof(struct linkjob) * (jobcount + 1));
+  bydirectory = (struct linkjob**) malloc(sizeof(struct linkjob*) * (jobcount + 1));
+  if (!jobs || !bydirectory) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  j = 0;
+  for (curfile = files; curfile; curfile = curfile->next) {
+    if (!curfile->hasdupes)
+      continue;
+
+    for (tmpfile = curfile->duplicates; tmpfile; tmpfile = tmpfile->duplicates) {
+      jobs[j].keep = curfile;
+      jobs[j].file = tmpfile;
+      jobs[j].directory = sdirname(0, tmpfile->d_name);
+      jobs[j].temporary = 0;
+      jobs[j].errorstring = 0;
+      jobs[j].linked = 0;
+
+      if (jobs[j].directory == 0) {
+        errormsg("out of memory\n");
+        exit(1);
       }
-      tmpfile = files->duplicates;
-      while (tmpfile != NULL) {
-        if (ISFLAG(flags, F_SHOWTIME))
-          printf("%s ", fmttime(tmpfile->mtime));
-	if (ISFLAG(flags, F_DSAMELINE)) escapefilename("\\ ", &tmpfile->d_name);
-	printf("%s%c", tmpfile->d_name, ISFLAG(flags, F_DSAMELINE)?' ':'\n');
-	tmpfile = tmpfile->duplicates;
+
+      bydirectory[j] = &jobs[j];
+      ++j;
+    }
+  }
+
+  qsort(bydirectory, jobcount, sizeof(struct linkjob*), sort_linkjobs_by_directory);
+
+  for (first = 0; first < jobcount && !got_sigint; first = last) {
+    last = first + 1;
+    while (last < jobcount && strcmp(bydirectory[last]->directory, bydirectory[first]->directory) == 0)
+      ++last;
+
+    for (j = first; j < last; ++j)
+      linkjob_prepare(bydirectory[j]);
+
+    for (j = first; j < last; ++j) {
+      if (bydirectory[j]->temporary == 0)
+        continue;
+
+      if (rename(bydirectory[j]->temporary, bydirectory[j]->file->d_name) == 0) {
+        bydirectory[j]->linked = 1;
+
+        /* rename() does nothing if both names already link to the same
+           file, as they do if the duplicate was relinked after it was
+           checked */
+        if (lstat(bydirectory[j]->temporary, &info) == 0)
+          remove(bydirectory[j]->temporary);
+      } else {
+        bydirectory[j]->errorstring = strerror(errno);
+        remove(bydirectory[j]->temporary);
+      }
+    }
+
+    fd = open(bydirectory[first]->directory, O_RDONLY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+
+  loginfo = 0;
+  if (logfile != 0)
+    loginfo = log_open(logfile, &log_error);
+
+#ifndef NO_SQLITE
+  hashdb_begintransaction(db);
+#endif
+
+  for (j = 0; j < jobcount; ++j) {
+    if (j == 0 || jobs[j].keep != jobs[j - 1].keep) {
+      printf("   [+] %s\n", jobs[j].keep->d_name);
+
+      if (loginfo) {
+        log_begin_set(loginfo);
+        log_file_remaining(loginfo, jobs[j].keep->d_name);
+      }
+    }
+
+    if (jobs[j].linked) {
+      printf("   [h] %s\n", jobs[j].file->d_name);
+
+      if (loginfo)
+        log_file_linked(loginfo, jobs[j].file->d_name);
+
+#ifndef NO_SQLITE
+      if (db && !ISFLAG(flags, F_READONLYCACHE) && jobs[j].temporary != 0) {
+        linkpath = getrealpath(jobs[j].file->d_name, GETREALPATH_IGNORE_MISSING_BASENAME);
+        if (linkpath != 0) {
+          hashdb_deletehashforpath(db, linkpath);
+          free(linkpath);
+        }
       }
-      printf("\n");
+#endif
+    } else {
+      printf("   [!] %s ", jobs[j].file->d_name);
+      printf("-- unable to link file: %s!\n", jobs[j].errorstring ? jobs[j].errorstring : "Interrupted");
 
+      if (loginfo)
+        log_file_remaining(loginfo, jobs[j].file->d_name);
     }
-      
-    files = files->next;
-  }
-}
-
-/*
-#define REVISE_APPEND "_tmp"
-char *revisefilename(char *path, int seq)
-{
-  int digits;
-  char *newpath;
-  char *scratch;
-  char *dot;
 
-  digits = numdigits(seq);
-  newpath = malloc(strlen(path) + strlen(REVISE_APPEND) + digits + 1);
-  if (!newpath) return newpath;
+    if (j + 1 == jobcount || jobs[j + 1].keep != jobs[j].keep) {
+      printf("\n");
 
-  scratch = malloc(strlen(path) + 1);
-  if (!scratch) return newpath;
+      if (loginfo)
+        log_end_set(loginfo);
+    }
 
-  strcpy(scratch, path);
-  dot = strrchr(scratch, '.');
-  if (dot) 
-  {
-    *dot = 0;
-    sprintf(newpath, "%s%s%d.%s", scratch, REVISE_APPEND, seq, dot + 1);
+    free(jobs[j].directory);
+    free(jobs[j].temporary);
   }
 
-  else
-  {
-    sprintf(newpath, "%s%s%d", path, REVISE_APPEND, seq);
-  }
+#ifndef NO_SQLITE
+  hashdb_committransaction(db);
+#endif
 
-  free(scratch);
+  if (loginfo)
+    log_close(loginfo);
 
-  return newpath;
-} */
+  free(bydirectory);
+  free(jobs);
+}
 
-int relink(char *oldfile, char *newfile)
+#ifdef HAVE_FIDEDUPERANGE
+/* Share storage between each set of duplicates and its first file. The
+   first file is only shown as kept if storage was shared with it. */
+void dedupefiles(file_t *files)
 {
-  dev_t od;
-  dev_t nd;
-  ino_t oi;
-  ino_t ni;
+  file_t *tmpfile;
+  char **errorstrings;
+  int *results;
+  size_t count;
+  size_t d;
+  int shared;
 
-  od = getdevice(oldfile);
-  oi = getinode(oldfile);
+  while (files) {
+    if (files->hasdupes) {
+      count = 0;
+      for (tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates)
+        ++count;
+
+      results = (int*) malloc(sizeof(int) * count);
+      errorstrings = (char**) malloc(sizeof(char*) * count);
+      if (results == 0 || errorstrings == 0) {
+        errormsg("out of memory\n");
+        exit(1);
+      }
 
-  if (link(oldfile, newfile) != 0)
-    return 0;
+      shared = 0;
+      d = 0;
+      for (tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates) {
+        /* with -H a duplicate may be a link to the file kept, which
+           already shares its storage and which the kernel rejects */
+        if (tmpfile->device == files->device && tmpfile->inode == files->inode)
+          results[d] = DEDUPE_OK;
+        else
+          results[d] = dedupefile(files, tmpfile, &errorstrings[d]);
+        if (results[d] == DEDUPE_OK)
+          shared = 1;
+        ++d;
+      }
 
-  /* make sure we're working with the right file (the one we created) */
-  nd = getdevice(newfile);
-  ni = getinode(newfile);
+      if (shared)
+        printf("   [+] %s\n", files->d_name);
 
-  if (nd != od || oi != ni)
-    return 0; /* file is not what we expected */
+      d = 0;
+      for (tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates) {
+        switch (results[d]) {
+        case DEDUPE_OK:
+          printf("   [=] %s\n", tmpfile->d_name);
+          break;
+        case DEDUPE_DIFFERS:
+          printf("   [!] %s ", tmpfile->d_name);
+          printf("-- contents differ; file not deduplicated!\n");
+          break;
+        default:
+          printf("   [!] %s ", tmpfile->d_name);
+          printf("-- unable to deduplicate file: %s!\n", errorstrings[d]);
+          break;
+        }
+        ++d;
+      }
 
-  return 1;
+      printf("\n");
+
+      free(results);
+      free(errorstrings);
+    }
+
+    files = files->next;
+  }
 }
+#endif
 
 void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
 {
@@ -1321,6 +2964,141 @@ void registerpair(file_t **matchlist, file_t *newmatch,
   }
 }
 
+/* a chain of duplicates registered before being confirmed byte by byte */
+struct pendingchain
+{
+  file_t **chain;
+  file_t *reference; /* file the chain was started from */
+};
+
+/* Order pending chains by where their reference files live, for --io-order. */
+int sortpending(const void *a, const void *b)
+{
+  return comparelocations(((struct pendingchain*) a)->reference, ((struct pendingchain*) b)->reference);
+}
+
+/* Borrowed signatures of members found identical to a member with a
+   signature of its own, or to one settled before them, take that
+   member's signature; the others are replaced by computed ones, so
+   that the next run need not borrow. */
+void settleborrowed(file_t **members, int *labels, size_t count)
+{
+  size_t m;
+  size_t o;
+
+  for (m = 0; m < count; ++m) {
+    if (!(members[m]->hashes & SIGNATURE_BORROWED) || labels[m] < 0)
+      continue;
+
+    for (o = 0; o < count; ++o)
+      if (labels[o] == labels[m] && !(members[o]->hashes & SIGNATURE_BORROWED))
+        break;
+
+    members[m]->hashes &= ~(HAS_SIGNATURE | SIGNATURE_BORROWED);
+
+    if (o < count) {
+      md5copy(members[m]->crcsignature, members[o]->crcsignature);
+      members[m]->hashes |= HAS_SIGNATURE;
+    }
+    else if (!getcrcsignature(members[m]))
+      continue;
+
+#ifndef NO_SQLITE
+    if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
+      hashdb_savehash(db, members[m]);
+#endif
+  }
+}
+
+/* Confirm a chain of duplicates by reading all of its members at once.
+   Members whose contents differ from the file the chain was started
+   from are unlinked from it; any of those that match one another form
+   chains of their own. */
+void confirmchain(struct pendingchain *pending)
+{
+  file_t **members;
+  file_t **heads;
+  file_t **tails;
+  file_t *traverse;
+  char **names;
+  int *labels;
+  size_t count;
+  size_t position;
+  size_t m;
+  int split;
+
+  count = 0;
+  for (traverse = *pending->chain; traverse != NULL; traverse = traverse->duplicates)
+    ++count;
+
+  members = (file_t**) malloc(sizeof(file_t*) * count);
+  heads = (file_t**) malloc(sizeof(file_t*) * count);
+  tails = (file_t**) malloc(sizeof(file_t*) * count);
+  names = (char**) malloc(sizeof(char*) * count);
+  labels = (int*) malloc(sizeof(int) * count);
+  if (members == NULL || heads == NULL || tails == NULL || names == NULL || labels == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  /* the reference file is compared first, followed by the rest in chain order */
+  members[0] = pending->reference;
+  m = 1;
+  for (traverse = *pending->chain; traverse != NULL; traverse = traverse->duplicates)
+    if (traverse != pending->reference)
+      members[m++] = traverse;
+
+  for (m = 0; m < count; ++m)
+    names[m] = members[m]->d_name;
+
+  confirmgroup(names, count, labels);
+
+  settleborrowed(members, labels, count);
+
+  split = 0;
+  for (m = 0; m < count; ++m)
+    if (labels[m] != 0)
+      split = 1;
+
+  if (split) {
+    for (m = 0; m < count; ++m)
+      heads[m] = tails[m] = NULL;
+
+    /* relink every member in its original order, chain by chain; the
+       members other than the reference were listed in that order */
+    position = 0;
+    traverse = *pending->chain;
+    while (traverse != NULL) {
+      file_t *next = traverse->duplicates;
+
+      traverse->duplicates = NULL;
+      traverse->hasdupes = 0;
+
+      m = traverse == pending->reference ? 0 : ++position;
+
+      if (labels[m] >= 0) {
+        if (heads[labels[m]] == NULL)
+          heads[labels[m]] = traverse;
+        else {
+          tails[labels[m]]->duplicates = traverse;
+          heads[labels[m]]->hasdupes = 1;
+        }
+        tails[labels[m]] = traverse;
+      }
+
+      traverse = next;
+    }
+
+    *pending->chain = heads[0] != NULL ? heads[0] : pending->reference;
+  }
+
+  free(members);
+  free(heads);
+  free(tails);
+  free(names);
+  free(labels);
+}
+
 void deletesuccessor(file_t **existing, file_t *duplicate, int matchconfirmed,
       int (*comparef)(file_t *f1, file_t *f2), struct log_info *loginfo)
 {
@@ -1425,9 +3203,17 @@ void help_text()
   printf("    prune                look through entire cache and delete orphaned entries\n");
   printf("    clear                clear all entries from cache\n");
   printf("    vacuum               reduce size of DB file, if possible\n");
+  printf("    trustdirectories     rescan a directory whose times have not changed\n");
+  printf("                         from the list of files recorded last time, without\n");
+  printf("                         reading it or checking its files; only for trees\n");
+  printf("                         whose files are never modified in place\n");
   printf("                         (note that the options prune, clear, and vacuum may be\n");
   printf("                         employed without supplying a DIRECTORY argument, and\n");
   printf("                         will take effect even if readonly is also specified)\n");
+#endif
+#ifndef NO_THREADS
+  printf(" -j --threads=N          read directories and compute file signatures using\n");
+  printf("                         N threads\n");
 #endif
   printf(" -n --noempty            exclude zero-length files from consideration\n");
   printf(" -A --nohidden           exclude hidden files from consideration\n");
@@ -1456,13 +3242,73 @@ void help_text()
   printf("                         prompting the user\n");
   printf(" -I --immediate          delete duplicates as they are encountered, without\n");
   printf("                         grouping into sets; implies --noprompt\n");
+  printf("    --format=FORMAT      list duplicates as plain text (FORMAT='text';\n");
+  printf("                         default), as a JSON array of sets ('json'), as\n");
+  printf("                         one JSON set per line ('ndjson'), or as file\n");
+  printf("                         names each ended by a null character, with an\n");
+  printf("                         extra null character ending each set ('null')\n");
+  printf("    --stream             list each set of duplicates as soon as every file\n");
+  printf("                         of its size has been checked, rather than after\n");
+  printf("                         all files have been checked; sets are then listed\n");
+  printf("                         by size rather than in the order files were found\n");
+  printf("    --link               instead of deleting duplicates, replace them with\n");
+  printf("                         hard links to the first file in each set\n");
+#ifdef HAVE_FIDEDUPERANGE
+  printf("    --dedupe             instead of deleting duplicates, make them share\n");
+  printf("                         storage with the first file in each set, keeping\n");
+  printf("                         every file in place (btrfs, XFS and other file\n");
+  printf("                         systems supporting FIDEDUPERANGE only)\n");
+#endif
   printf(" -p --permissions        don't consider files with different owner/group or\n");
   printf("                         permission bits as duplicates\n");
   printf(" -o --order=BY           select sort order for output and deleting; by file\n");
   printf("                         modification time (BY='time'; default), status\n");
   printf("                         change time (BY='ctime'), or filename (BY='name')\n");
   printf(" -i --reverse            reverse order while sorting\n");
-  printf(" -l --log=LOGFILE        log file deletion choices to LOGFILE\n");
+  printf(" -l --log=LOGFILE        log file deletion (or --link) choices to LOGFILE\n");
+#ifdef HAVE_GETOPT_H
+  printf("    --io=METHOD          select how file contents are read when computing\n");
+  printf("                         signatures: through the C library (METHOD='stdio';\n");
+  printf("                         default)");
+#ifdef HAVE_MMAP_IO
+  printf(", by mapping them into memory\n");
+  printf("                         (METHOD='mmap')");
+#endif
+#ifdef HAVE_IO_URING
+  printf(", or with many reads in flight at once\n");
+  printf("                         using io_uring (METHOD='uring')");
+#endif
+  printf("\n");
+  printf("    --io-order=ORDER     read files in the order they are laid out on\n");
+  printf("                         disk rather than the order they were found:\n");
+  printf("                         by physical location where the file system\n");
+  printf("                         reports it (ORDER='physical'), by inode number\n");
+  printf("                         (ORDER='inode'), or not at all (ORDER='none';\n");
+  printf("                         default)\n");
+  printf("    --device-depth=N     when computing signatures with --threads or\n");
+  printf("                         --io=uring, read at most N files at once from\n");
+  printf("                         any one device, sharing the rest of the threads\n");
+  printf("                         or reads among other devices (0 for no limit;\n");
+  printf("                         default)\n");
+  printf("    --hash=NAME          select the hash function used to compare file\n");
+  printf("                         signatures: MD5 (NAME='md5'; default)");
+#ifdef HAVE_XXHASH
+  printf(", the much\n");
+  printf("                         faster xxHash XXH3 128-bit hash (NAME='xxh128')");
+#endif
+#ifdef HAVE_BLAKE3
+  printf(", or\n");
+  printf("                         the cryptographic BLAKE3 hash (NAME='blake3')");
+#endif
+  printf("\n");
+  printf("    --stages=LIST        before comparing full signatures, compare files\n");
+  printf("                         with matching partial signatures by the stages\n");
+  printf("                         in LIST, in order: their last block (tail) or a\n");
+  printf("                         number of blocks spread through the file\n");
+  printf("                         (sample or sample:N; default is 8 blocks)\n");
+  printf("    --stats              after matching, print file and I/O statistics to\n");
+  printf("                         standard error\n");
+#endif
   printf(" -v --version            display fdupes version\n");
   printf(" -h --help               display this help message\n\n");
 #ifndef HAVE_GETOPT_H
@@ -1483,6 +3329,8 @@ void close_db_on_exit()
 {
   if (db != 0)
   {
+    hashdb_stopwriter(db);
+
     if (!sqlite3_get_autocommit(db))
       hashdb_committransaction(db);
 
@@ -1505,6 +3353,15 @@ int main(int argc, char **argv) {
   file_t *curfile;
   file_t **match = NULL;
   filetree_t *checktree = NULL;
+  struct pendingchain *pending;
+  size_t pendingcount;
+  file_t **sizeorder;
+  size_t sortedcount;
+  size_t precomputed;
+  int precompute;
+  size_t bucketstart;
+  size_t bucketend;
+  size_t i;
   int filecount = 0;
   int progress = 0;
   uint64_t last_progress = 0;
@@ -1518,6 +3375,7 @@ int main(int argc, char **argv) {
   char *endptr;
   char *cachehome;
   char *cachepath;
+  int (*scan)(char *dir, file_t **filelistp, struct stat *logfile_status);
 
 #ifdef HAVE_GETOPT_H
   static struct option long_options[] = 
@@ -1550,6 +3408,17 @@ int main(int argc, char **argv) {
     { "log", 1, 0, 'l' },
     { "deferconfirmation", 0, 0, 'D' },
     { "cache", 0, 0, 'c' },
+    { "threads", 1, 0, 'j' },
+    { "stats", 0, 0, OPT_STATS },
+    { "dedupe", 0, 0, OPT_DEDUPE },
+    { "link", 0, 0, OPT_LINK },
+    { "format", 1, 0, OPT_FORMAT },
+    { "stream", 0, 0, OPT_STREAM },
+    { "io", 1, 0, OPT_IO },
+    { "hash", 1, 0, OPT_HASH },
+    { "stages", 1, 0, OPT_STAGES },
+    { "io-order", 1, 0, OPT_IO_ORDER },
+    { "device-depth", 1, 0, OPT_DEVICE_DEPTH },
     { 0, 0, 0, 0 }
   };
 #define GETOPT getopt_long
@@ -1563,7 +3432,7 @@ int main(int argc, char **argv) {
 
   oldargv = cloneargs(argc, argv);
 
-  while ((opt = GETOPT(argc, argv, "frRq1StsHG:L:nAdPvhNImMpo:il:Dcx:"
+  while ((opt = GETOPT(argc, argv, "frRq1StsHG:L:nAdPvhNImMpo:il:Dcx:j:"
 #ifdef HAVE_GETOPT_H
           , long_options, NULL
 #endif
@@ -1670,6 +3539,93 @@ int main(int argc, char **argv) {
     case 'c':
       SETFLAG(flags, F_CACHESIGNATURES);
       break;
+    case 'j':
+      threads = strtol(optarg, &endptr, 10);
+      if (optarg[0] == '\0' || *endptr != '\0' || threads < 1)
+      {
+        errormsg("invalid value for --threads: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_STREAM:
+      SETFLAG(flags, F_STREAMMATCHES);
+      break;
+    case OPT_FORMAT:
+      outputformat = findoutputformat(optarg);
+      if (outputformat < 0) {
+        errormsg("invalid value for --format: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_LINK:
+      SETFLAG(flags, F_LINKFILES);
+      break;
+    case OPT_DEDUPE:
+#ifdef HAVE_FIDEDUPERANGE
+      SETFLAG(flags, F_DEDUPEFILES);
+#else
+      errormsg("--dedupe is not supported in this fdupes build\n");
+      exit(1);
+#endif
+      break;
+    case OPT_STATS:
+      SETFLAG(flags, F_SHOWSTATS);
+      break;
+    case OPT_IO:
+      if (!strcasecmp("stdio", optarg)) {
+        iomode = IO_STDIO;
+      } else if (!strcasecmp("uring", optarg)) {
+#ifdef HAVE_IO_URING
+        iomode = IO_URING;
+#else
+        errormsg("--io=uring is not supported in this fdupes build\n");
+        exit(1);
+#endif
+      } else if (!strcasecmp("mmap", optarg)) {
+#ifdef HAVE_MMAP_IO
+        iomode = IO_MMAP;
+#else
+        errormsg("--io=mmap is not supported in this fdupes build\n");
+        exit(1);
+#endif
+      } else {
+        errormsg("invalid value for --io: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_DEVICE_DEPTH:
+      devicedepth = strtol(optarg, &endptr, 10);
+      if (optarg[0] == '\0' || *endptr != '\0' || optarg[0] == '-')
+      {
+        errormsg("invalid value for --device-depth: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_IO_ORDER:
+      if (!strcasecmp("none", optarg))
+        ioorder = IO_ORDER_NONE;
+      else if (!strcasecmp("inode", optarg))
+        ioorder = IO_ORDER_INODE;
+      else if (!strcasecmp("physical", optarg))
+        ioorder = IO_ORDER_PHYSICAL;
+      else {
+        errormsg("invalid value for --io-order: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_STAGES:
+      if (!parsestages(optarg)) {
+        errormsg("invalid value for --stages: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_HASH:
+      hashfunction = findhashfunction(optarg);
+      if (hashfunction == 0) {
+        errormsg("unsupported hash function: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
     case 'x':
       if (strcmp("cache.readonly", optarg) == 0)
         SETFLAG(flags, F_READONLYCACHE);
@@ -1679,6 +3635,8 @@ int main(int argc, char **argv) {
         SETFLAG(flags, F_CLEARCACHE);
       else if (strcmp("cache.vacuum", optarg) == 0)
         SETFLAG(flags, F_VACUUMCACHE);
+      else if (strcmp("cache.trustdirectories", optarg) == 0)
+        SETFLAG(flags, F_TRUSTDIRECTORIES);
       else {
         errormsg("unrecognized option '-x %s'\n", optarg);
         fprintf(stderr, "Try `fdupes --help' for more information.\n");
@@ -1702,7 +3660,8 @@ int main(int argc, char **argv) {
       ISFLAG(flags, F_CLEARCACHE) ||
       ISFLAG(flags, F_PRUNECACHE) ||
       ISFLAG(flags, F_READONLYCACHE) ||
-      ISFLAG(flags, F_VACUUMCACHE)
+      ISFLAG(flags, F_VACUUMCACHE) ||
+      ISFLAG(flags, F_TRUSTDIRECTORIES)
   ) {
     errormsg("file signature database is not supported in this fdupes build\n");
     exit(1);
@@ -1713,7 +3672,8 @@ int main(int argc, char **argv) {
       ISFLAG(flags, F_CLEARCACHE) ||
       ISFLAG(flags, F_PRUNECACHE) ||
       ISFLAG(flags, F_READONLYCACHE) ||
-      ISFLAG(flags, F_VACUUMCACHE)
+      ISFLAG(flags, F_VACUUMCACHE) ||
+      ISFLAG(flags, F_TRUSTDIRECTORIES)
     ) {
       errormsg("-xcache parameters must be accompanied by --cache option\n");
       exit(1);
@@ -1721,6 +3681,13 @@ int main(int argc, char **argv) {
   }
 #endif
 
+#ifdef NO_THREADS
+  if (threads > 1) {
+    errormsg("multi-threaded hashing is not supported in this fdupes build\n");
+    exit(1);
+  }
+#endif
+
   if (ISFLAG(flags, F_RECURSE) && ISFLAG(flags, F_RECURSEAFTER)) {
     errormsg("options --recurse and --recurse: are not compatible\n");
     exit(1);
@@ -1731,13 +3698,38 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  if (ISFLAG(flags, F_DEDUPEFILES) && (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_SUMMARIZEMATCHES))) {
+    errormsg("option --dedupe is not compatible with --delete or --summarize\n");
+    exit(1);
+  }
+
+  if (outputformat != FORMAT_TEXT && (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_SUMMARIZEMATCHES) || ISFLAG(flags, F_LINKFILES) || ISFLAG(flags, F_DEDUPEFILES))) {
+    errormsg("option --format only applies to lists of duplicates\n");
+    exit(1);
+  }
+
+  if (ISFLAG(flags, F_STREAMMATCHES) && (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_SUMMARIZEMATCHES) || ISFLAG(flags, F_LINKFILES) || ISFLAG(flags, F_DEDUPEFILES))) {
+    errormsg("option --stream only applies to lists of duplicates\n");
+    exit(1);
+  }
+
+  if (ISFLAG(flags, F_LINKFILES) && (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_SUMMARIZEMATCHES) || ISFLAG(flags, F_DEDUPEFILES))) {
+    errormsg("option --link is not compatible with --delete, --summarize or --dedupe\n");
+    exit(1);
+  }
+
+  if (devicedepth > 0 && threads == 1 && iomode != IO_URING) {
+    errormsg("--device-depth only works with --threads or --io=uring\n");
+    exit(1);
+  }
+
   if (ISFLAG(flags, F_DEFERCONFIRMATION) && (!ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_NOPROMPT)))
   {
     errormsg("--deferconfirmation only works with interactive deletion modes\n");
     exit(1);
   }
 
-  if (!ISFLAG(flags, F_DELETEFILES)) {
+  if (!ISFLAG(flags, F_DELETEFILES) && !ISFLAG(flags, F_LINKFILES)) {
     logfile = 0;
     loginfo = 0;
   }
@@ -1818,12 +3810,38 @@ int main(int argc, char **argv) {
     else if (ISFLAG(flags, F_PRUNECACHE)) {
       hashdb_foreachdirectory(db, 0, delist_directory_if_missing);
       hashdb_foreachhash(db, 0, delist_hash_if_orphaned);
+      flushdelistings();
     }
   }
 #endif
 
+  stats.stages = stagecount + 2;
+  stats.stagenames[0] = "head";
+  for (x = 0; x < stagecount; ++x)
+    stats.stagenames[x + 1] = stagename(&stages[x]);
+  stats.stagenames[stagecount + 1] = "full";
+
   register_sigint_handler();
 
+#ifdef HAVE_MMAP_IO
+  if (iomode == IO_MMAP)
+    mmapio_init();
+#endif
+
+  arena_init(&filearena);
+
+  scan = grokdir;
+#ifndef NO_THREADS
+  /* trusted directory listings are read from the cache, which only the
+     main thread uses */
+  if (threads > 1)
+    scan = scandirectory;
+#ifndef NO_SQLITE
+  if (db != 0 && ISFLAG(flags, F_TRUSTDIRECTORIES))
+    scan = grokdir;
+#endif
+#endif
+
   if (ISFLAG(flags, F_RECURSEAFTER)) {
     firstrecurse = nonoptafter("--recurse:", argc, oldargv, argv, optind, &foundoption);
 
@@ -1842,16 +3860,16 @@ int main(int argc, char **argv) {
 
     /* F_RECURSE is not set for directories before --recurse: */
     for (x = optind; x < firstrecurse; x++)
-      filecount += grokdir(argv[x], &files, logfile ? &logfile_status : 0);
+      filecount += scan(argv[x], &files, logfile ? &logfile_status : 0);
 
     /* Set F_RECURSE for directories after --recurse: */
     SETFLAG(flags, F_RECURSE);
 
     for (x = firstrecurse; x < argc; x++)
-      filecount += grokdir(argv[x], &files, logfile ? &logfile_status : 0);
+      filecount += scan(argv[x], &files, logfile ? &logfile_status : 0);
   } else {
     for (x = optind; x < argc; x++)
-      filecount += grokdir(argv[x], &files, logfile ? &logfile_status : 0);
+      filecount += scan(argv[x], &files, logfile ? &logfile_status : 0);
   }
 
   if (!files) {
@@ -1859,63 +3877,148 @@ int main(int argc, char **argv) {
     exit(0);
   }
 
-  curfile = files;
+  sizeorder = groupbysize(files, &sortedcount);
+  if (sizeorder == 0) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
 
-  while (curfile) {
-    if (got_sigint) {
-      printf("\n");
-      exit(0);
+  stats.files = sortedcount;
+
+#ifndef NO_SQLITE
+  /* hashing only ever adds to the cache from here on */
+  if (db != 0 && !ISFLAG(flags, F_READONLYCACHE))
+    hashdb_startwriter(db);
+#endif
+
+  /* only files sharing their size with another are ever opened or listed */
+  for (bucketstart = 0; bucketstart < sortedcount; bucketstart = bucketend) {
+    bucketend = bucketstart + 1;
+    while (bucketend < sortedcount && sizeorder[bucketend]->size == sizeorder[bucketstart]->size)
+      ++bucketend;
+
+    if (bucketend - bucketstart > 1)
+      for (i = bucketstart; i < bucketend; ++i)
+        filepath(sizeorder[i]);
+  }
+
+  if (ISFLAG(flags, F_STREAMMATCHES) && outputformat != FORMAT_TEXT)
+    matchwriter_begin(stdout);
+
+  precompute = threads > 1 || iomode == IO_URING || ioorder != IO_ORDER_NONE || canborrowsignatures();
+  precomputed = 0;
+
+  pending = (struct pendingchain*) malloc(sizeof(struct pendingchain) * (sortedcount + 1));
+  if (pending == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  for (bucketstart = 0; bucketstart < sortedcount; bucketstart = bucketend) {
+    bucketend = bucketstart + 1;
+    while (bucketend < sortedcount && sizeorder[bucketend]->size == sizeorder[bucketstart]->size)
+      ++bucketend;
+
+    if (precompute && bucketstart >= precomputed) {
+      precomputed = ISFLAG(flags, F_STREAMMATCHES) ? streambatchend(sizeorder, sortedcount, bucketstart) : sortedcount;
+      precomputesignatures(sizeorder + bucketstart, precomputed - bucketstart);
     }
 
-    if (!checktree) 
-      registerfile(&checktree, curfile);
-    else 
-      match = checkmatch(&checktree, checktree, curfile);
+    ++stats.sizeclasses;
 
-    if (match != NULL) {
-      file1 = fopen(curfile->d_name, "rb");
-      if (!file1) {
-	curfile = curfile->next;
-	continue;
-      }
-      
-      file2 = fopen((*match)->d_name, "rb");
-      if (!file2) {
-	fclose(file1);
-	curfile = curfile->next;
-	continue;
-      }
+    /* a file with a unique size cannot have duplicates; skip it unread */
+    if (bucketend - bucketstart == 1) {
+      ++stats.singletons;
+      ++progress;
+      continue;
+    }
 
-      if (ISFLAG(flags, F_DELETEFILES) && ISFLAG(flags, F_IMMEDIATE))
-      {
-          deletesuccessor(match, curfile, confirmmatch(file1, file2),
-              ordertype == ORDER_MTIME ? sort_pairs_by_mtime :
-              ordertype == ORDER_CTIME ? sort_pairs_by_ctime :
-                                         sort_pairs_by_filename, loginfo );
+    checktree = NULL;
+    pendingcount = 0;
+    fullsignatures = needfullsignatures(bucketend - bucketstart);
+
+    for (i = bucketstart; i < bucketend; ++i) {
+      curfile = sizeorder[i];
+
+      if (got_sigint) {
+        printf("\n");
+        exit(0);
       }
-      else if (ISFLAG(flags, F_DEFERCONFIRMATION) || ISFLAG(flags, F_QUICKSUMMARY) || confirmmatch(file1, file2))
+
+      match = NULL;
+
+      if (!checktree)
+        registerfile(&checktree, curfile);
+      else
+        match = checkmatch(&checktree, checktree, curfile);
+
+      if (match != NULL && !ISFLAG(flags, F_DEFERCONFIRMATION) && !ISFLAG(flags, F_QUICKSUMMARY) &&
+          !(ISFLAG(flags, F_DELETEFILES) && ISFLAG(flags, F_IMMEDIATE))) {
+        /* register now, confirm the whole chain at once when this size is
+           done; with --dedupe, the kernel compares contents instead */
+        if (!(*match)->hasdupes && !ISFLAG(flags, F_DEDUPEFILES)) {
+          pending[pendingcount].chain = match;
+          pending[pendingcount].reference = *match;
+          ++pendingcount;
+        }
+
         registerpair(match, curfile,
             ordertype == ORDER_MTIME ? sort_pairs_by_mtime :
             ordertype == ORDER_CTIME ? sort_pairs_by_ctime :
                                        sort_pairs_by_filename );
+      }
+      else if (match != NULL) {
+        file1 = fopen(curfile->d_name, "rb");
+        file2 = file1 ? fopen((*match)->d_name, "rb") : 0;
 
-      fclose(file1);
-      fclose(file2);
-    }
+        if (file1 && file2) {
+          if (ISFLAG(flags, F_DELETEFILES) && ISFLAG(flags, F_IMMEDIATE))
+          {
+              deletesuccessor(match, curfile, confirmmatch(file1, file2),
+                  ordertype == ORDER_MTIME ? sort_pairs_by_mtime :
+                  ordertype == ORDER_CTIME ? sort_pairs_by_ctime :
+                                             sort_pairs_by_filename, loginfo );
+          }
+          else
+            registerpair(match, curfile,
+                ordertype == ORDER_MTIME ? sort_pairs_by_mtime :
+                ordertype == ORDER_CTIME ? sort_pairs_by_ctime :
+                                           sort_pairs_by_filename );
+        }
 
-    curfile = curfile->next;
+        if (file2)
+          fclose(file2);
+
+        if (file1)
+          fclose(file1);
+      }
 
-    if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-      now = now64();
-      if ( now - last_progress > FDUPES_PROGRESS_REFRESH_MS ) {
-        last_progress = now;
-        fprintf(stderr, "\rProgress [%d/%d] %d%% ", progress, filecount,
-         (int)((float) progress / (float) filecount * 100.0));
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        now = now64();
+        if ( now - last_progress > FDUPES_PROGRESS_REFRESH_MS ) {
+          last_progress = now;
+          fprintf(stderr, "\rProgress [%d/%d] %d%% ", progress, filecount,
+           (int)((float) progress / (float) filecount * 100.0));
+        }
       }
       progress++;
     }
+
+    if (ioorder != IO_ORDER_NONE)
+      qsort(pending, pendingcount, sizeof(struct pendingchain), sortpending);
+
+    for (i = 0; i < pendingcount; ++i)
+      confirmchain(&pending[i]);
+
+    purgetree(checktree);
+
+    if (ISFLAG(flags, F_STREAMMATCHES))
+      streammatches(sizeorder + bucketstart, bucketend - bucketstart);
   }
 
+  free(pending);
+  free(sizeorder);
+
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%40s\r", " ");
 
   if (loginfo != 0)
@@ -1926,7 +4029,11 @@ int main(int argc, char **argv) {
 
 #ifndef NO_SQLITE
   if (db != 0)
+  {
+    hashdb_stopwriter(db);
+    flushdelistings();
     hashdb_committransaction(db);
+  }
 #endif
 
   if (ISFLAG(flags, F_DELETEFILES))
@@ -1973,6 +4080,22 @@ int main(int argc, char **argv) {
     }
   }
 
+  else if (ISFLAG(flags, F_LINKFILES))
+    linkfiles(files, logfile);
+
+#ifdef HAVE_FIDEDUPERANGE
+  else if (ISFLAG(flags, F_DEDUPEFILES))
+    dedupefiles(files);
+#endif
+
+  else if (ISFLAG(flags, F_STREAMMATCHES)) {
+    if (outputformat != FORMAT_TEXT)
+      matchwriter_end();
+  }
+
+  else if (outputformat != FORMAT_TEXT)
+    writematches(files);
+
   else 
 
     if (ISFLAG(flags, F_SUMMARIZEMATCHES))
@@ -1984,19 +4107,20 @@ int main(int argc, char **argv) {
 
   while (files) {
     curfile = files->next;
-    free(files->d_name);
-    free(files->crcsignature);
-    free(files->crcpartial);
-    free(files);
+    for (x = 0; x < MAX_STAGES; ++x)
+      free(files->crcstages[x]);
     files = curfile;
   }
 
+  arena_free(&filearena);
+
   for (x = 0; x < argc; x++)
     free(oldargv[x]);
 
   free(oldargv);
 
-  purgetree(checktree);
+  if (ISFLAG(flags, F_SHOWSTATS))
+    printstats(stderr);
 
   return 0;
 }
@@ -24,22 +24,70 @@
 
 #include "config.h"
 #include <sys/stat.h>
-#include "md5/md5.h"
+#include "hashfunction.h"
+
+/* values of file_t.locationtype */
+#define LOCATION_UNKNOWN 0
+#define LOCATION_PHYSICAL 1
+#define LOCATION_INODE 2
+
+/* maximum number of intermediate matching stages; see stages.h */
+#define MAX_STAGES 2
+
+/* values of file_t.hashes */
+#define HAS_PARTIAL 1
+#define HAS_SIGNATURE 2
+#define SIGNATURE_BORROWED 4 /* crcsignature is a match's, yet to be confirmed */
+
+#define HASPARTIAL(file) ((file)->hashes & HAS_PARTIAL)
+#define HASSIGNATURE(file) ((file)->hashes & HAS_SIGNATURE)
+
+/* values of struct directory.cacheid besides actual ids */
+#define DIRECTORY_ID_UNKNOWN 0 /* not looked up yet */
+#define DIRECTORY_ID_MISSING -1 /* not in the hash database */
+
+/* A scanned directory, recorded once and shared by every file in it. */
+struct directory {
+  const char *prefix; /* path as given, ending in '/' */
+  const char *realpath; /* resolved path; only set when caching hashes */
+  struct directory *parent; /* 0 for directories named on the command line */
+  long long cacheid; /* id in the hash database, or one of the above */
+  int preloaded; /* set once its cached hashes were read all at once */
+};
 
 typedef struct _file {
-  char *d_name;
+  char *d_name; /* full path; only set once built by filepath() */
+  struct directory *directory;
   off_t size;
-  md5_byte_t *crcpartial;
-  md5_byte_t *crcsignature;
+  md5_byte_t crcpartial[HASH_DIGEST_LENGTH];
+  md5_byte_t crcsignature[HASH_DIGEST_LENGTH];
+  md5_byte_t *crcstages[MAX_STAGES];
+  unsigned long long location; /* where the file lives on its device */
   dev_t device;
   ino_t inode;
   time_t mtime;
   time_t ctime;
   long mtime_nsec;
   long ctime_nsec;
-  int hasdupes; /* true only if file is first on duplicate chain */
   struct _file *duplicates;
   struct _file *next;
+  unsigned char hashes; /* which of crcpartial and crcsignature are set */
+  unsigned char stagesreached; /* bit n set once matching reached stage n */
+  unsigned char locationtype; /* how location was found; see ioorder.h */
+  unsigned char hasdupes; /* true only if file is first on duplicate chain */
+  unsigned char islink; /* true if found through a symbolic link */
+  char name[]; /* name of the file within its directory */
 } file_t;
 
+char *filepath(file_t *file);
+
+/* how file contents are read when computing signatures and comparing */
+typedef enum {
+  IO_STDIO = 0,
+  IO_URING,
+  IO_MMAP
+} iotype_t;
+
+extern iotype_t iomode;
+
 #endif
\ No newline at end of file
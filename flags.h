@@ -29,6 +29,11 @@
 #define F_READONLYCACHE     0x400000
 #define F_VACUUMCACHE       0x800000
 #define F_QUICKSUMMARY     0x1000000
+#define F_SHOWSTATS         0x2000000
+#define F_DEDUPEFILES       0x4000000
+#define F_LINKFILES         0x8000000
+#define F_STREAMMATCHES     0x10000000
+#define F_TRUSTDIRECTORIES  0x20000000
 
 extern unsigned long flags;
 
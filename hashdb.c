@@ -25,18 +25,22 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifndef NO_THREADS
+  #include <pthread.h>
+#endif
 #include "hashdb.h"
 #include "getrealpath.h"
 #include "sbasename.h"
 #include "sdirname.h"
 #include "errormsg.h"
+#include "hashfunction.h"
+#include "listing.h"
 
-#define DATABASE_VERSION 1
+#define DATABASE_VERSION 3
 
-#define HASH_FUNCTION_MD5 1
-
-#define HASH_FUNCTION HASH_FUNCTION_MD5
-#define HASH_FUNCTION_OUTPUT_LENGTH 16
+#define HASH_FUNCTION_OUTPUT_LENGTH HASH_DIGEST_LENGTH
 
 void md5copy(md5_byte_t *to, const md5_byte_t *from);
 
@@ -48,6 +52,9 @@ sqlite3_stmt **hashdb_statements[HASHDB_MAX_STATEMENTS];
 
 size_t hashdb_statements_top;
 
+/* set by hashdb_open(); see hashdb__anyhashes() */
+int hashdb_hadhashes = 0;
+
 sqlite3_stmt *query_begintransaction = 0;
 sqlite3_stmt *query_committransaction = 0;
 sqlite3_stmt *query_rollbacktransaction = 0;
@@ -59,11 +66,74 @@ sqlite3_stmt *query_cleardirectories = 0;
 sqlite3_stmt *query_foreachdirectory = 0;
 sqlite3_stmt *query_foreachdirectorywithin = 0;
 sqlite3_stmt *query_loadhash = 0;
+sqlite3_stmt *query_preloadhashes = 0;
+sqlite3_stmt *query_findhash = 0;
 sqlite3_stmt *query_savehash = 0;
 sqlite3_stmt *query_deletehash = 0;
 sqlite3_stmt *query_deletehashforpath = 0;
 sqlite3_stmt *query_foreachhash = 0;
 sqlite3_stmt *query_foreachhashwithin = 0;
+sqlite3_stmt *query_loadstage = 0;
+sqlite3_stmt *query_savestage = 0;
+sqlite3_stmt *query_deletestages = 0;
+sqlite3_stmt *query_deletestagesforpath = 0;
+sqlite3_stmt *query_loadlisting = 0;
+sqlite3_stmt *query_savelisting = 0;
+
+#ifndef NO_THREADS
+/* writes queued before the writer thread takes them; see
+   hashdb_startwriter() */
+#define HASHDB_WRITER_BATCH 4096
+
+/* seconds between the writer thread's commits; committing every batch
+   would rewrite the pages of the hashes_by_file index, whose keys are
+   scattered, every time */
+#define HASHDB_WRITER_INTERVAL 5
+
+#define HASHDB_WRITE_HASHES 0
+#define HASHDB_WRITE_STAGE 1
+
+/* A cache write waiting for the writer thread. Digests are copied, as
+   the entry's own may still change; its location and status may not. */
+struct hashdb_write
+{
+  const file_t *entry;
+  int kind;
+  int stage;
+  int parameter;
+  unsigned char hashes;
+  md5_byte_t partialhash[HASH_FUNCTION_OUTPUT_LENGTH];
+  md5_byte_t hash[HASH_FUNCTION_OUTPUT_LENGTH];
+};
+
+struct hashdb_writer
+{
+  sqlite3 *db;
+  struct hashdb_write *queue; /* filled by callers */
+  struct hashdb_write *batch; /* being written */
+  size_t count;
+  int writing;
+  int flushing;
+  int running;
+  int stopping;
+  pthread_t thread;
+  pthread_mutex_t mutex; /* guards the queue */
+  pthread_cond_t changed;
+  pthread_mutex_t database; /* guards the connection */
+};
+
+struct hashdb_writer hashdb_writer = { 0 };
+
+static int hashdb__queuewrite(const struct hashdb_write *write);
+
+/* While the writer thread runs it shares the connection, so every other
+   use of the database must hold its lock. */
+#define HASHDB_LOCK() do { if (hashdb_writer.running) pthread_mutex_lock(&hashdb_writer.database); } while (0)
+#define HASHDB_UNLOCK() do { if (hashdb_writer.running) pthread_mutex_unlock(&hashdb_writer.database); } while (0)
+#else
+#define HASHDB_LOCK() do { } while (0)
+#define HASHDB_UNLOCK() do { } while (0)
+#endif
 
 sqlite3_stmt **hashdb__newstatement(sqlite3_stmt **statement)
 {
@@ -74,6 +144,31 @@ sqlite3_stmt **hashdb__newstatement(sqlite3_stmt **statement)
   return statement;
 }
 
+/* Devices, inodes and times are stored as integers, as of version 2;
+   version 1 stored the raw bytes of each as a blob. As of version 3, a
+   file has a row for each hash function it was hashed with. */
+int hashdb__createhashtable(sqlite3 *db)
+{
+  return sqlite3_exec(db,
+    "CREATE TABLE IF NOT EXISTS hashes ("
+    "  directory_id INTEGER REFERENCES directories(id) ON DELETE CASCADE,"
+    "  filename TEXT,"
+    "  device INTEGER,"
+    "  inode INTEGER,"
+    "  size INTEGER,"
+    "  ctime INTEGER,"
+    "  mtime INTEGER,"
+    "  ctime_nsec INTEGER,"
+    "  mtime_nsec INTEGER,"
+    "  partial_hash BLOB,"
+    "  partial_hash_bytes INTEGER,"
+    "  hash BLOB,"
+    "  hash_function INTEGER,"
+    "  PRIMARY KEY (directory_id, filename, hash_function)"
+    ")",
+    0, 0, 0);
+}
+
 int hashdb__createtables(sqlite3 *db)
 {
   int result;
@@ -92,32 +187,70 @@ int hashdb__createtables(sqlite3 *db)
   if (result != SQLITE_OK)
     return result;
 
-  result = sqlite3_exec(db,
-    "CREATE TABLE IF NOT EXISTS hashes ("
+  result = hashdb__createhashtable(db);
+
+  if (result != SQLITE_OK) {
+    hashdb_rollbacktransaction(db);
+    return result;
+  }
+
+  hashdb_committransaction(db);
+
+  return SQLITE_OK;
+}
+
+/* Digests for intermediate matching stages. Created on demand so that
+   databases made by earlier versions gain the table when opened. */
+int hashdb__createstagetable(sqlite3 *db)
+{
+  return sqlite3_exec(db,
+    "CREATE TABLE IF NOT EXISTS stage_hashes ("
     "  directory_id INTEGER REFERENCES directories(id) ON DELETE CASCADE,"
     "  filename TEXT,"
-    "  inode BLOB,"
+    "  stage INTEGER,"
+    "  stage_parameter INTEGER,"
+    "  block_bytes INTEGER,"
+    "  device INTEGER,"
+    "  inode INTEGER,"
     "  size INTEGER,"
-    "  ctime BLOB,"
-    "  mtime BLOB,"
+    "  ctime INTEGER,"
+    "  mtime INTEGER,"
     "  ctime_nsec INTEGER,"
     "  mtime_nsec INTEGER,"
-    "  partial_hash BLOB,"
-    "  partial_hash_bytes INTEGER,"
     "  hash BLOB,"
     "  hash_function INTEGER,"
-    "  PRIMARY KEY (directory_id, filename)"
+    "  PRIMARY KEY (directory_id, filename, stage, hash_function)"
     ")",
     0, 0, 0);
+}
 
-  if (result != SQLITE_OK) {
-    hashdb_rollbacktransaction(db);
-    return result;
-  }
-
-  hashdb_committransaction(db);
+/* What each directory held when last scanned with -x cache.trustdirectories,
+   along with its status at the time and the options that shaped the
+   scan. Created on demand, like stage_hashes. */
+int hashdb__createlistingtable(sqlite3 *db)
+{
+  return sqlite3_exec(db,
+    "CREATE TABLE IF NOT EXISTS directory_listings ("
+    "  directory_id INTEGER PRIMARY KEY REFERENCES directories(id) ON DELETE CASCADE,"
+    "  device INTEGER,"
+    "  inode INTEGER,"
+    "  ctime INTEGER,"
+    "  mtime INTEGER,"
+    "  ctime_nsec INTEGER,"
+    "  mtime_nsec INTEGER,"
+    "  scan_options TEXT,"
+    "  listing BLOB"
+    ")",
+    0, 0, 0);
+}
 
-  return SQLITE_OK;
+/* Finds a file's hashes wherever it was last seen, as after a rename or
+   move; see hashdb_loadhash(). */
+int hashdb__createhashindex(sqlite3 *db)
+{
+  return sqlite3_exec(db,
+    "CREATE INDEX IF NOT EXISTS hashes_by_file ON hashes (device, inode, size, mtime)",
+    0, 0, 0);
 }
 
 int hashdb__preparestatements(sqlite3 *db)
@@ -167,11 +300,19 @@ int hashdb__preparestatements(sqlite3 *db)
     return result;
 
   /* hash operations */
-  result = PREPARE_STATEMENT("SELECT hashes.partial_hash, hashes.hash FROM hashes INNER JOIN directories ON hashes.directory_id = directories.id WHERE directories.full_path = ? AND hashes.filename = ? AND hashes.inode = ? AND hashes.size = ? AND hashes.ctime = ? AND hashes.mtime = ? AND hashes.ctime_nsec = ? AND hashes.mtime_nsec = ? AND hashes.partial_hash_bytes = ? AND hashes.hash_function = ?", query_loadhash);
+  result = PREPARE_STATEMENT("SELECT hashes.partial_hash, hashes.hash FROM hashes WHERE hashes.directory_id = ? AND hashes.filename = ? AND hashes.inode = ? AND hashes.size = ? AND hashes.ctime = ? AND hashes.mtime = ? AND hashes.ctime_nsec = ? AND hashes.mtime_nsec = ? AND hashes.partial_hash_bytes = ? AND hashes.hash_function = ?", query_loadhash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("SELECT hashes.filename, hashes.inode, hashes.size, hashes.ctime, hashes.mtime, hashes.ctime_nsec, hashes.mtime_nsec, hashes.partial_hash, hashes.hash FROM hashes WHERE hashes.directory_id = ? AND hashes.partial_hash_bytes = ? AND hashes.hash_function = ?", query_preloadhashes);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("SELECT hashes.partial_hash, hashes.hash, hashes.ctime, hashes.ctime_nsec, directories.full_path, hashes.filename FROM hashes INNER JOIN directories ON hashes.directory_id = directories.id WHERE NOT (hashes.directory_id = ? AND hashes.filename = ?) AND hashes.device = ? AND hashes.inode = ? AND hashes.size = ? AND hashes.mtime = ? AND hashes.mtime_nsec = ? AND hashes.partial_hash_bytes = ? AND hashes.hash_function = ? ORDER BY hashes.hash IS NULL", query_findhash);
   if (result != SQLITE_OK)
     return result;
 
-  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO hashes (directory_id, filename, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, partial_hash, partial_hash_bytes, hash, hash_function) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_savehash);
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO hashes (directory_id, filename, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, partial_hash, partial_hash_bytes, hash, hash_function) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_savehash);
   if (result != SQLITE_OK)
     return result;
 
@@ -183,11 +324,37 @@ int hashdb__preparestatements(sqlite3 *db)
   if (result != SQLITE_OK)
     return result;
 
-  result = PREPARE_STATEMENT("SELECT hashes.directory_id, hashes.filename, directories.full_path AS directory FROM hashes INNER JOIN directories ON hashes.directory_id = directories.id", query_foreachhash);
+  result = PREPARE_STATEMENT("SELECT DISTINCT hashes.directory_id, hashes.filename, directories.full_path AS directory FROM hashes INNER JOIN directories ON hashes.directory_id = directories.id", query_foreachhash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("SELECT DISTINCT hashes.directory_id, hashes.filename, directories.full_path AS directory FROM hashes INNER JOIN directories ON hashes.directory_id = directories.id WHERE directories.id = :directory_id", query_foreachhashwithin);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* stage operations */
+  result = PREPARE_STATEMENT("SELECT stage_hashes.hash FROM stage_hashes WHERE stage_hashes.directory_id = ? AND stage_hashes.filename = ? AND stage_hashes.stage = ? AND stage_hashes.stage_parameter = ? AND stage_hashes.block_bytes = ? AND stage_hashes.inode = ? AND stage_hashes.size = ? AND stage_hashes.ctime = ? AND stage_hashes.mtime = ? AND stage_hashes.ctime_nsec = ? AND stage_hashes.mtime_nsec = ? AND stage_hashes.hash_function = ?", query_loadstage);
   if (result != SQLITE_OK)
     return result;
 
-  result = PREPARE_STATEMENT("SELECT hashes.directory_id, hashes.filename, directories.full_path AS directory FROM hashes INNER JOIN directories ON hashes.directory_id = directories.id WHERE directories.id = :directory_id", query_foreachhashwithin);
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO stage_hashes (directory_id, filename, stage, stage_parameter, block_bytes, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, hash, hash_function, device) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_savestage);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM stage_hashes WHERE directory_id = ? AND filename = ?", query_deletestages);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM stage_hashes WHERE filename = ? AND directory_id IN (SELECT id FROM directories WHERE full_path = ?)", query_deletestagesforpath);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* listing operations */
+  result = PREPARE_STATEMENT("SELECT listing FROM directory_listings WHERE directory_id = ? AND device = ? AND inode = ? AND ctime = ? AND mtime = ? AND ctime_nsec = ? AND mtime_nsec = ? AND scan_options = ?", query_loadlisting);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO directory_listings (directory_id, device, inode, ctime, mtime, ctime_nsec, mtime_nsec, scan_options, listing) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)", query_savelisting);
   if (result != SQLITE_OK)
     return result;
 
@@ -245,6 +412,169 @@ int hashdb__iscompatible(int major)
   return major <= DATABASE_VERSION;
 }
 
+/* Decode version 1 blobs, the raw bytes of a time_t, ino_t or dev_t,
+   into integers. */
+static void hashdb__v1time(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  time_t value;
+
+  (void) argc;
+
+  if (sqlite3_value_bytes(argv[0]) != sizeof(value))
+    return;
+
+  memcpy(&value, sqlite3_value_blob(argv[0]), sizeof(value));
+
+  sqlite3_result_int64(context, (sqlite3_int64) value);
+}
+
+static void hashdb__v1inode(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  ino_t value;
+
+  (void) argc;
+
+  if (sqlite3_value_bytes(argv[0]) != sizeof(value))
+    return;
+
+  memcpy(&value, sqlite3_value_blob(argv[0]), sizeof(value));
+
+  sqlite3_result_int64(context, (sqlite3_int64) value);
+}
+
+static void hashdb__v1device(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  dev_t value;
+
+  (void) argc;
+
+  if (sqlite3_value_bytes(argv[0]) != sizeof(value))
+    return;
+
+  memcpy(&value, sqlite3_value_blob(argv[0]), sizeof(value));
+
+  sqlite3_result_int64(context, (sqlite3_int64) value);
+}
+
+static int hashdb__execall(sqlite3 *db, const char **statements, size_t count)
+{
+  size_t s;
+  int result;
+
+  for (s = 0; s < count; ++s)
+  {
+    result = sqlite3_exec(db, statements[s], 0, 0, 0);
+    if (result != SQLITE_OK)
+      return result;
+  }
+
+  return SQLITE_OK;
+}
+
+/* Convert a version 1 database's blobs into integers, keeping every
+   cached hash. Devices were not recorded, so rows carried over are found
+   by path only until next saved. */
+int hashdb__upgradetoversion2(sqlite3 *db)
+{
+  static const char *rename[] = {
+    "ALTER TABLE hashes RENAME TO hashes_v1",
+    "ALTER TABLE stage_hashes RENAME TO stage_hashes_v1",
+    "ALTER TABLE directory_listings RENAME TO directory_listings_v1"
+  };
+  static const char *copy[] = {
+    "INSERT INTO hashes (directory_id, filename, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, partial_hash, partial_hash_bytes, hash, hash_function)"
+    " SELECT directory_id, filename, NULL, v1_inode(inode), size, v1_time(ctime), v1_time(mtime), ctime_nsec, mtime_nsec, partial_hash, partial_hash_bytes, hash, hash_function FROM hashes_v1",
+    "INSERT INTO stage_hashes (directory_id, filename, stage, stage_parameter, block_bytes, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, hash, hash_function)"
+    " SELECT directory_id, filename, stage, stage_parameter, block_bytes, NULL, v1_inode(inode), size, v1_time(ctime), v1_time(mtime), ctime_nsec, mtime_nsec, hash, hash_function FROM stage_hashes_v1",
+    "INSERT INTO directory_listings (directory_id, device, inode, ctime, mtime, ctime_nsec, mtime_nsec, scan_options, listing)"
+    " SELECT directory_id, v1_device(device), v1_inode(inode), v1_time(ctime), v1_time(mtime), ctime_nsec, mtime_nsec, scan_options, listing FROM directory_listings_v1",
+    "DROP TABLE hashes_v1",
+    "DROP TABLE stage_hashes_v1",
+    "DROP TABLE directory_listings_v1"
+  };
+  int result;
+
+  sqlite3_create_function(db, "v1_time", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, hashdb__v1time, 0, 0);
+  sqlite3_create_function(db, "v1_inode", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, hashdb__v1inode, 0, 0);
+  sqlite3_create_function(db, "v1_device", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, hashdb__v1device, 0, 0);
+
+  result = sqlite3_exec(db, "BEGIN", 0, 0, 0);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* tables created on demand may be missing */
+  result = hashdb__createstagetable(db);
+  if (result == SQLITE_OK)
+    result = hashdb__createlistingtable(db);
+
+  if (result == SQLITE_OK)
+    result = hashdb__execall(db, rename, sizeof(rename) / sizeof(rename[0]));
+  if (result == SQLITE_OK)
+    result = hashdb__createhashtable(db);
+  if (result == SQLITE_OK)
+    result = hashdb__createstagetable(db);
+  if (result == SQLITE_OK)
+    result = hashdb__createlistingtable(db);
+  if (result == SQLITE_OK)
+    result = hashdb__execall(db, copy, sizeof(copy) / sizeof(copy[0]));
+  if (result == SQLITE_OK)
+    result = hashdb__setdatabaseversion(db, 2);
+
+  if (result != SQLITE_OK)
+  {
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return result;
+  }
+
+  return sqlite3_exec(db, "COMMIT", 0, 0, 0);
+}
+
+/* Give the hash function its place in the keys of the hash tables, so
+   that rows for one function no longer replace those for another. */
+int hashdb__upgradetoversion3(sqlite3 *db)
+{
+  static const char *rename[] = {
+    "DROP INDEX IF EXISTS hashes_by_file",
+    "ALTER TABLE hashes RENAME TO hashes_v2",
+    "ALTER TABLE stage_hashes RENAME TO stage_hashes_v2"
+  };
+  static const char *copy[] = {
+    "INSERT INTO hashes (directory_id, filename, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, partial_hash, partial_hash_bytes, hash, hash_function)"
+    " SELECT directory_id, filename, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, partial_hash, partial_hash_bytes, hash, hash_function FROM hashes_v2",
+    "INSERT INTO stage_hashes (directory_id, filename, stage, stage_parameter, block_bytes, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, hash, hash_function)"
+    " SELECT directory_id, filename, stage, stage_parameter, block_bytes, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, hash, hash_function FROM stage_hashes_v2",
+    "DROP TABLE hashes_v2",
+    "DROP TABLE stage_hashes_v2"
+  };
+  int result;
+
+  result = sqlite3_exec(db, "BEGIN", 0, 0, 0);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* the stage table is created on demand, so may be missing */
+  result = hashdb__createstagetable(db);
+
+  if (result == SQLITE_OK)
+    result = hashdb__execall(db, rename, sizeof(rename) / sizeof(rename[0]));
+  if (result == SQLITE_OK)
+    result = hashdb__createhashtable(db);
+  if (result == SQLITE_OK)
+    result = hashdb__createstagetable(db);
+  if (result == SQLITE_OK)
+    result = hashdb__execall(db, copy, sizeof(copy) / sizeof(copy[0]));
+  if (result == SQLITE_OK)
+    result = hashdb__setdatabaseversion(db, 3);
+
+  if (result != SQLITE_OK)
+  {
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return result;
+  }
+
+  return sqlite3_exec(db, "COMMIT", 0, 0, 0);
+}
+
 int hashdb__insertdirectory(sqlite3 *db, const char *name, const char *full_path, const sqlite3_int64 *parent)
 {
   int result;
@@ -297,6 +627,33 @@ int hashdb__enable_write_ahead(sqlite3 *db)
   return sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0) == SQLITE_OK;
 }
 
+/* Let the page cache hold the hashes_by_file index, whose pages are
+   touched in no particular order. Pages are allocated only as needed. */
+int hashdb__enlarge_cache(sqlite3 *db)
+{
+  return sqlite3_exec(db, "PRAGMA cache_size = -65536", 0, 0, 0) == SQLITE_OK;
+}
+
+/* Whether any hashes were cached when the database was opened, and so
+   might be found under another path by hashdb__findhash(). */
+int hashdb__anyhashes(sqlite3 *db)
+{
+  sqlite3_stmt *statement;
+  int value;
+  int result;
+
+  result = sqlite3_prepare_v2(db, "SELECT EXISTS (SELECT 1 FROM hashes)", -1, &statement, 0);
+  if (result != SQLITE_OK)
+    return 0;
+
+  result = sqlite3_step(statement);
+  value = result == SQLITE_ROW && sqlite3_column_int(statement, 0);
+
+  sqlite3_finalize(statement);
+
+  return value;
+}
+
 sqlite3 *hashdb_open(const char *path)
 {
   sqlite3 *db;
@@ -341,6 +698,39 @@ sqlite3 *hashdb_open(const char *path)
       return 0;
     }
   }
+  else if (version < DATABASE_VERSION) {
+    result = SQLITE_OK;
+
+    if (version == 1)
+      result = hashdb__upgradetoversion2(db);
+
+    if (result == SQLITE_OK)
+      result = hashdb__upgradetoversion3(db);
+
+    if (result != SQLITE_OK) {
+      sqlite3_close_v2(db);
+      return 0;
+    }
+  }
+
+  if (hashdb__createstagetable(db) != SQLITE_OK) {
+    sqlite3_close_v2(db);
+    return 0;
+  }
+
+  if (hashdb__createlistingtable(db) != SQLITE_OK) {
+    sqlite3_close_v2(db);
+    return 0;
+  }
+
+  if (hashdb__createhashindex(db) != SQLITE_OK) {
+    sqlite3_close_v2(db);
+    return 0;
+  }
+
+  hashdb__enlarge_cache(db);
+
+  hashdb_hadhashes = hashdb__anyhashes(db);
 
   if (hashdb__preparestatements(db) != SQLITE_OK) {
     sqlite3_close_v2(db);
@@ -527,44 +917,123 @@ int hashdb_foreachdirectory(sqlite3 *db, const sqlite3_int64 *parent, int (*call
   return result == SQLITE_DONE;
 }
 
-int hashdb_loadhash(sqlite3 *db, const file_t *entry, md5_byte_t **partialhash, md5_byte_t **fullhash)
+/* Look up the id of a directory recorded by the scanner, unless already
+   known, adding the directory to the database if create is set. Returns
+   0 if the directory is not in the database. */
+int hashdb__directoryid(sqlite3 *db, struct directory *directory, int create)
 {
-  int result;
-  int hashsize;
+  sqlite3_int64 directoryid;
+
+  if (directory->cacheid == DIRECTORY_ID_UNKNOWN)
+  {
+    if (hashdb_getdirectoryid(db, directory->realpath, &directoryid))
+      directory->cacheid = directoryid;
+    else
+      directory->cacheid = DIRECTORY_ID_MISSING;
+  }
+
+  if (directory->cacheid == DIRECTORY_ID_MISSING)
+  {
+    if (!create || !hashdb_savedirectory(db, directory->realpath))
+      return 0;
+
+    directory->cacheid = sqlite3_last_insert_rowid(db);
+  }
+
+  return 1;
+}
+
+/* Find the id of the directory an entry is cached under, adding the
+   directory to the database if create is set, and bind it and the
+   entry's name to the first two parameters of query. The directory
+   record made by the scanner supplies the real path, and keeps the id
+   once found; only entries reached through a symbolic link, whose
+   target may lie anywhere, need their own path resolved. Returns 0 if
+   the directory is not in the database. */
+int hashdb__bindlocation(sqlite3 *db, sqlite3_stmt *query, const file_t *entry, int create)
+{
+  struct directory *directory = entry->directory;
+  sqlite3_int64 directoryid;
   char *realpath;
   char *name;
 
-  realpath = getrealpath(entry->d_name, 0);
-  if (realpath == 0)
-    return 0;
-
-  name = malloc(strlen(realpath) + 1);
-  if (name == 0)
+  if (entry->islink || directory->realpath == 0)
   {
+    realpath = getrealpath(entry->d_name, 0);
+    if (realpath == 0)
+      return 0;
+
+    name = malloc(strlen(realpath) + 1);
+    if (name == 0)
+    {
+      free(realpath);
+      return 0;
+    }
+
+    sdirname(name, realpath);
+
+    if (!hashdb_getdirectoryid(db, name, &directoryid))
+    {
+      if (!create || !hashdb_savedirectory(db, name))
+      {
+        free(name);
+        free(realpath);
+        return 0;
+      }
+
+      directoryid = sqlite3_last_insert_rowid(db);
+    }
+
+    sbasename(name, realpath);
+
+    sqlite3_bind_int64(query, 1, directoryid);
+    sqlite3_bind_text(query, 2, name, strlen(name), SQLITE_TRANSIENT);
+
+    free(name);
     free(realpath);
-    return 0;
+
+    return 1;
   }
 
-  sdirname(name, realpath);
-  sqlite3_bind_text(query_loadhash, 1, name, strlen(name), SQLITE_TRANSIENT);
+  if (!hashdb__directoryid(db, directory, create))
+    return 0;
+
+  sqlite3_bind_int64(query, 1, directory->cacheid);
+  sqlite3_bind_text(query, 2, entry->name, strlen(entry->name), SQLITE_STATIC);
 
-  sbasename(name, realpath);
-  sqlite3_bind_text(query_loadhash, 2, name, strlen(name), SQLITE_TRANSIENT);
+  return 1;
+}
+
+/* copy a blob column into to if it is exactly size bytes long */
+static int hashdb__columnblob(sqlite3_stmt *query, int column, void *to, size_t size)
+{
+  if ((size_t) sqlite3_column_bytes(query, column) != size)
+    return 0;
 
-  sqlite3_bind_blob(query_loadhash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  memcpy(to, sqlite3_column_blob(query, column), size);
+
+  return 1;
+}
+
+static int hashdb__loadhash(sqlite3 *db, file_t *entry)
+{
+  int result;
+  int hashsize;
+
+  if (!hashdb__bindlocation(db, query_loadhash, entry, 0))
+    return 0;
+
+  sqlite3_bind_int64(query_loadhash, 3, (sqlite3_int64) entry->inode);
   sqlite3_bind_int64(query_loadhash, 4, entry->size);
-  sqlite3_bind_blob(query_loadhash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
-  sqlite3_bind_blob(query_loadhash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadhash, 5, (sqlite3_int64) entry->ctime);
+  sqlite3_bind_int64(query_loadhash, 6, (sqlite3_int64) entry->mtime);
   sqlite3_bind_int64(query_loadhash, 7, entry->ctime_nsec);
   sqlite3_bind_int64(query_loadhash, 8, entry->mtime_nsec);
   sqlite3_bind_int64(query_loadhash, 9, PARTIAL_MD5_SIZE);
-  sqlite3_bind_int(query_loadhash, 10, HASH_FUNCTION);
+  sqlite3_bind_int(query_loadhash, 10, hashfunction);
 
   result = sqlite3_step(query_loadhash);
 
-  free(name);
-  free(realpath);
-
   if (result != SQLITE_ROW)
   {
     sqlite3_reset(query_loadhash);
@@ -575,108 +1044,343 @@ int hashdb_loadhash(sqlite3 *db, const file_t *entry, md5_byte_t **partialhash,
 
   if (hashsize == HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
   {
-      *partialhash = (md5_byte_t*) malloc(HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t));
-      if (*partialhash == NULL) {
-          errormsg("out of memory\n");
-          exit(1);
-      }
-
-      md5copy(*partialhash, sqlite3_column_blob(query_loadhash, 0));
-  }
-  else
-  {
-      *partialhash = 0;
+      md5copy(entry->crcpartial, sqlite3_column_blob(query_loadhash, 0));
+      entry->hashes |= HAS_PARTIAL;
   }
 
   hashsize = sqlite3_column_bytes(query_loadhash, 1);
 
   if (hashsize == HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
   {
-      *fullhash = (md5_byte_t*) malloc(HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t));
-      if (*fullhash == NULL) {
-          errormsg("out of memory\n");
-          exit(1);
-      }
+      md5copy(entry->crcsignature, sqlite3_column_blob(query_loadhash, 1));
+      entry->hashes |= HAS_SIGNATURE;
+  }
+
+  sqlite3_reset(query_loadhash);
+
+  return entry->hashes != 0;
+}
+
+/* Whether a row found under another path by hashdb__findhash() may be
+   trusted: either its change time still matches, or the file no longer
+   lives at that path (it was renamed or moved away, which updates the
+   change time). A file edited in place keeps its path, and is not
+   trusted even if its modification time was put back. */
+static int hashdb__foundfile(sqlite3_stmt *query, const file_t *entry)
+{
+  struct stat info;
+  const char *directory;
+  const char *filename;
+  char *path;
+  int moved;
+
+  if (sqlite3_column_int64(query, 2) == (sqlite3_int64) entry->ctime &&
+      sqlite3_column_int64(query, 3) == entry->ctime_nsec)
+    return 1;
+
+  directory = (const char *) sqlite3_column_text(query, 4);
+  filename = (const char *) sqlite3_column_text(query, 5);
+  if (directory == 0 || filename == 0)
+    return 0;
+
+  path = malloc(strlen(directory) + strlen(filename) + 2);
+  if (path == 0)
+    return 0;
+
+  strcpy(path, directory);
+  strcat(path, "/");
+  strcat(path, filename);
+
+  moved = lstat(path, &info) != 0 || info.st_dev != entry->device || info.st_ino != entry->inode;
+
+  free(path);
+
+  return moved;
+}
+
+/* Look for the hashes of the file an entry names under any other path,
+   by device, inode, size and modification time. Unlike the change time,
+   these survive a rename or move within the device. */
+static int hashdb__findhash(sqlite3 *db, file_t *entry)
+{
+  int result;
 
-      md5copy(*fullhash, sqlite3_column_blob(query_loadhash, 1));
+  /* never the entry's own row, which already failed its checks */
+  if (!hashdb__bindlocation(db, query_findhash, entry, 0))
+  {
+    sqlite3_bind_int64(query_findhash, 1, -1);
+    sqlite3_bind_text(query_findhash, 2, "", 0, SQLITE_STATIC);
   }
-  else
+
+  sqlite3_bind_int64(query_findhash, 3, (sqlite3_int64) entry->device);
+  sqlite3_bind_int64(query_findhash, 4, (sqlite3_int64) entry->inode);
+  sqlite3_bind_int64(query_findhash, 5, entry->size);
+  sqlite3_bind_int64(query_findhash, 6, (sqlite3_int64) entry->mtime);
+  sqlite3_bind_int64(query_findhash, 7, entry->mtime_nsec);
+  sqlite3_bind_int64(query_findhash, 8, PARTIAL_MD5_SIZE);
+  sqlite3_bind_int(query_findhash, 9, hashfunction);
+
+  result = sqlite3_step(query_findhash);
+
+  while (result == SQLITE_ROW && !hashdb__foundfile(query_findhash, entry))
+    result = sqlite3_step(query_findhash);
+
+  if (result == SQLITE_ROW)
   {
-      *fullhash = 0;
+    if (hashdb__columnblob(query_findhash, 0, entry->crcpartial, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t)))
+      entry->hashes |= HAS_PARTIAL;
+
+    if (hashdb__columnblob(query_findhash, 1, entry->crcsignature, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t)))
+      entry->hashes |= HAS_SIGNATURE;
   }
 
-  sqlite3_reset(query_loadhash);
+  sqlite3_reset(query_findhash);
+
+  return entry->hashes != 0;
+}
+
+/* Fill in an entry's cached hashes. Returns 1 if found under its own
+   path, HASHDB_FOUND_ELSEWHERE if found only under another path to the
+   same file (one it was renamed or moved from, or a hard link), and 0
+   otherwise. */
+int hashdb_loadhash(sqlite3 *db, file_t *entry)
+{
+  int result = 0;
+
+  HASHDB_LOCK();
+
+  /* everything cached for this directory was already handed out */
+  if (entry->islink || !entry->directory->preloaded)
+    result = hashdb__loadhash(db, entry);
+
+  if (!result && hashdb_hadhashes && hashdb__findhash(db, entry))
+    result = HASHDB_FOUND_ELSEWHERE;
 
-  return *partialhash || *fullhash;
+  HASHDB_UNLOCK();
+
+  return result;
+}
+
+/* A row of the hashes table, as read by hashdb_preloaddirectory(). */
+struct hashdb_preloadrow
+{
+  char *filename;
+  ino_t inode;
+  off_t size;
+  time_t ctime;
+  time_t mtime;
+  long ctime_nsec;
+  long mtime_nsec;
+  unsigned char hashes; /* HAS_PARTIAL and HAS_SIGNATURE, as in file_t */
+  md5_byte_t partialhash[HASH_FUNCTION_OUTPUT_LENGTH];
+  md5_byte_t fullhash[HASH_FUNCTION_OUTPUT_LENGTH];
+};
+
+static int hashdb__comparepreloadrows(const void *a, const void *b)
+{
+  return strcmp(((const struct hashdb_preloadrow*) a)->filename, ((const struct hashdb_preloadrow*) b)->filename);
 }
 
-int hashdb_savehash(sqlite3 *db, const file_t *entry, md5_byte_t *partialhash, md5_byte_t *fullhash)
+/* Read every cached hash for the files in a directory recorded by the
+   scanner with a single query, for hashdb_applypreload() to hand out
+   as the directory's files are found. Afterwards, hashdb_loadhash()
+   knows not to query again for files in this directory. Returns 0 if
+   nothing could be read; preload is then left empty. */
+int hashdb_preloaddirectory(sqlite3 *db, struct directory *directory, struct hashdb_preload *preload)
 {
+  struct hashdb_preloadrow *rows;
+  struct hashdb_preloadrow *row;
+  size_t allocated = 0;
   int result;
-  char *realpath;
-  char *name;
-  sqlite3_int64 directoryid;
 
-  realpath = getrealpath(entry->d_name, 0);
-  if (realpath == 0)
-    return 0;
+  preload->rows = 0;
+  preload->count = 0;
 
-  name = malloc(strlen(realpath) + 1);
-  if (name == 0)
-  {
-    free(realpath);
+  if (directory->realpath == 0 || !hashdb__directoryid(db, directory, 0))
     return 0;
-  }
 
-  sdirname(name, realpath);
+  sqlite3_bind_int64(query_preloadhashes, 1, directory->cacheid);
+  sqlite3_bind_int64(query_preloadhashes, 2, PARTIAL_MD5_SIZE);
+  sqlite3_bind_int(query_preloadhashes, 3, hashfunction);
 
-  if (!hashdb_getdirectoryid(db, name, &directoryid))
+  result = sqlite3_step(query_preloadhashes);
+  while (result == SQLITE_ROW)
   {
-    if (!hashdb_savedirectory(db, name))
+    if (preload->count == allocated)
     {
-      free(name);
-      free(realpath);
-      return 0;
+      allocated = allocated ? allocated * 2 : 64;
+
+      rows = (struct hashdb_preloadrow*) realloc(preload->rows, sizeof(struct hashdb_preloadrow) * allocated);
+      if (rows == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+
+      preload->rows = rows;
+    }
+
+    row = &preload->rows[preload->count];
+
+    if (sqlite3_column_type(query_preloadhashes, 0) == SQLITE_TEXT)
+    {
+      row->filename = strdup((const char*) sqlite3_column_text(query_preloadhashes, 0));
+      if (row->filename == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+
+      row->inode = (ino_t) sqlite3_column_int64(query_preloadhashes, 1);
+      row->size = sqlite3_column_int64(query_preloadhashes, 2);
+      row->ctime = (time_t) sqlite3_column_int64(query_preloadhashes, 3);
+      row->mtime = (time_t) sqlite3_column_int64(query_preloadhashes, 4);
+      row->ctime_nsec = sqlite3_column_int64(query_preloadhashes, 5);
+      row->mtime_nsec = sqlite3_column_int64(query_preloadhashes, 6);
+
+      row->hashes = 0;
+      if (hashdb__columnblob(query_preloadhashes, 7, row->partialhash, sizeof(row->partialhash)))
+        row->hashes |= HAS_PARTIAL;
+      if (hashdb__columnblob(query_preloadhashes, 8, row->fullhash, sizeof(row->fullhash)))
+        row->hashes |= HAS_SIGNATURE;
+
+      ++preload->count;
     }
 
-    directoryid = sqlite3_last_insert_rowid(db);
+    result = sqlite3_step(query_preloadhashes);
+  }
+
+  sqlite3_reset(query_preloadhashes);
+
+  if (result != SQLITE_DONE)
+  {
+    hashdb_freepreload(preload);
+    return 0;
   }
 
-  sbasename(name, realpath);
+  qsort(preload->rows, preload->count, sizeof(struct hashdb_preloadrow), hashdb__comparepreloadrows);
+
+  directory->preloaded = 1;
+
+  return 1;
+}
+
+/* Fill in an entry's signatures from its directory's preloaded rows, if
+   one matches its name and is still current. Returns 0 if none does. */
+int hashdb_applypreload(const struct hashdb_preload *preload, file_t *entry)
+{
+  struct hashdb_preloadrow key;
+  struct hashdb_preloadrow *row;
+
+  if (preload->count == 0 || entry->islink)
+    return 0;
+
+  key.filename = entry->name;
+
+  row = (struct hashdb_preloadrow*) bsearch(&key, preload->rows, preload->count, sizeof(struct hashdb_preloadrow), hashdb__comparepreloadrows);
+  if (row == 0)
+    return 0;
+
+  if
+  (
+    row->inode != entry->inode ||
+    row->size != entry->size ||
+    row->ctime != entry->ctime ||
+    row->mtime != entry->mtime ||
+    row->ctime_nsec != entry->ctime_nsec ||
+    row->mtime_nsec != entry->mtime_nsec
+  )
+    return 0;
+
+  if (row->hashes & HAS_PARTIAL)
+    md5copy(entry->crcpartial, row->partialhash);
 
-  sqlite3_bind_int64(query_savehash, 1, directoryid);
-  sqlite3_bind_text(query_savehash, 2, name, strlen(name), SQLITE_TRANSIENT);
-  sqlite3_bind_blob(query_savehash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
-  sqlite3_bind_int64(query_savehash, 4, entry->size);
-  sqlite3_bind_blob(query_savehash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
-  sqlite3_bind_blob(query_savehash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
-  sqlite3_bind_int64(query_savehash, 7, entry->ctime_nsec);
-  sqlite3_bind_int64(query_savehash, 8, entry->mtime_nsec);
+  if (row->hashes & HAS_SIGNATURE)
+    md5copy(entry->crcsignature, row->fullhash);
 
-  if (partialhash)
-    sqlite3_bind_blob(query_savehash, 9, partialhash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
+  entry->hashes |= row->hashes;
+
+  return row->hashes != 0;
+}
+
+void hashdb_freepreload(struct hashdb_preload *preload)
+{
+  size_t r;
+
+  for (r = 0; r < preload->count; ++r)
+    free(preload->rows[r].filename);
+
+  free(preload->rows);
+
+  preload->rows = 0;
+  preload->count = 0;
+}
+
+static int hashdb__savehash(sqlite3 *db, const file_t *entry, unsigned char hashes, const md5_byte_t *partialhash, const md5_byte_t *hash)
+{
+  int result;
+
+  if (!hashdb__bindlocation(db, query_savehash, entry, 1))
+    return 0;
+
+  sqlite3_bind_int64(query_savehash, 3, (sqlite3_int64) entry->device);
+  sqlite3_bind_int64(query_savehash, 4, (sqlite3_int64) entry->inode);
+  sqlite3_bind_int64(query_savehash, 5, entry->size);
+  sqlite3_bind_int64(query_savehash, 6, (sqlite3_int64) entry->ctime);
+  sqlite3_bind_int64(query_savehash, 7, (sqlite3_int64) entry->mtime);
+  sqlite3_bind_int64(query_savehash, 8, entry->ctime_nsec);
+  sqlite3_bind_int64(query_savehash, 9, entry->mtime_nsec);
+
+  if (hashes & HAS_PARTIAL)
+    sqlite3_bind_blob(query_savehash, 10, partialhash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
   else
-    sqlite3_bind_null(query_savehash, 9);
+    sqlite3_bind_null(query_savehash, 10);
 
-  sqlite3_bind_int64(query_savehash, 10, PARTIAL_MD5_SIZE);
+  sqlite3_bind_int64(query_savehash, 11, PARTIAL_MD5_SIZE);
 
-  if (fullhash)
-    sqlite3_bind_blob(query_savehash, 11, fullhash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
+  if (hashes & HAS_SIGNATURE)
+    sqlite3_bind_blob(query_savehash, 12, hash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
   else
-    sqlite3_bind_null(query_savehash, 11);
+    sqlite3_bind_null(query_savehash, 12);
 
-  sqlite3_bind_int(query_savehash, 12, HASH_FUNCTION);
+  sqlite3_bind_int(query_savehash, 13, hashfunction);
 
   result = sqlite3_step(query_savehash);
 
-  free(name);
-  free(realpath);
-
   sqlite3_reset(query_savehash);
 
   return result == SQLITE_DONE;
 }
 
+int hashdb_savehash(sqlite3 *db, const file_t *entry)
+{
+  unsigned char hashes = entry->hashes;
+#ifndef NO_THREADS
+  struct hashdb_write write;
+#endif
+
+  /* not known to be the entry's own yet */
+  if (hashes & SIGNATURE_BORROWED)
+    hashes &= ~HAS_SIGNATURE;
+
+#ifndef NO_THREADS
+  if (hashdb_writer.running)
+  {
+    write.entry = entry;
+    write.kind = HASHDB_WRITE_HASHES;
+    write.hashes = hashes;
+    if (hashes & HAS_PARTIAL)
+      md5copy(write.partialhash, entry->crcpartial);
+    if (hashes & HAS_SIGNATURE)
+      md5copy(write.hash, entry->crcsignature);
+
+    return hashdb__queuewrite(&write);
+  }
+#endif
+
+  return hashdb__savehash(db, entry, hashes, entry->crcpartial, entry->crcsignature);
+}
+
 int hashdb_foreachhash(sqlite3 *db, sqlite3_int64 *directoryid, int (*callback)(const sqlite3_int64, const char*, const char*))
 {
   int result;
@@ -723,10 +1427,20 @@ int hashdb_deletehash(sqlite3 *db, sqlite3_int64 directoryid, const char *filena
 
   sqlite3_reset(query_deletehash);
 
+  if (result != SQLITE_DONE)
+    return 0;
+
+  sqlite3_bind_int64(query_deletestages, 1, directoryid);
+  sqlite3_bind_text(query_deletestages, 2, filename, strlen(filename), SQLITE_TRANSIENT);
+
+  result = sqlite3_step(query_deletestages);
+
+  sqlite3_reset(query_deletestages);
+
   return result == SQLITE_DONE;
 }
 
-int hashdb_deletehashforpath(sqlite3 *db, const char *path)
+static int hashdb__deletehashforpath(sqlite3 *db, const char *path)
 {
   int result;
   char *name;
@@ -738,9 +1452,11 @@ int hashdb_deletehashforpath(sqlite3 *db, const char *path)
 
   sbasename(name, path);
   sqlite3_bind_text(query_deletehashforpath, 1, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_text(query_deletestagesforpath, 1, name, strlen(name), SQLITE_TRANSIENT);
 
   sdirname(name, path);
   sqlite3_bind_text(query_deletehashforpath, 2, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_text(query_deletestagesforpath, 2, name, strlen(name), SQLITE_TRANSIENT);
 
   free(name);
 
@@ -748,5 +1464,402 @@ int hashdb_deletehashforpath(sqlite3 *db, const char *path)
 
   sqlite3_reset(query_deletehashforpath);
 
+  if (result != SQLITE_DONE)
+    return 0;
+
+  result = sqlite3_step(query_deletestagesforpath);
+
+  sqlite3_reset(query_deletestagesforpath);
+
   return result == SQLITE_DONE;
-}
\ No newline at end of file
+}
+
+int hashdb_deletehashforpath(sqlite3 *db, const char *path)
+{
+  int result;
+
+#ifndef NO_THREADS
+  /* a queued write must not bring the deleted file's hashes back */
+  if (hashdb_writer.running)
+  {
+    pthread_mutex_lock(&hashdb_writer.mutex);
+
+    hashdb_writer.flushing = 1;
+    pthread_cond_broadcast(&hashdb_writer.changed);
+
+    while (hashdb_writer.count > 0 || hashdb_writer.writing)
+      pthread_cond_wait(&hashdb_writer.changed, &hashdb_writer.mutex);
+
+    hashdb_writer.flushing = 0;
+
+    pthread_mutex_unlock(&hashdb_writer.mutex);
+  }
+#endif
+
+  HASHDB_LOCK();
+  result = hashdb__deletehashforpath(db, path);
+
+  HASHDB_UNLOCK();
+
+  return result;
+}
+
+/* Bind the first eleven parameters of a stage query: the entry's
+   directory id and file name, the stage's identity, and the entry's
+   inode, size and times. Returns 0 on failure. */
+int hashdb__bindstage(sqlite3 *db, sqlite3_stmt *query, const file_t *entry, int stage, int parameter, int load)
+{
+  if (!hashdb__bindlocation(db, query, entry, !load))
+    return 0;
+
+  sqlite3_bind_int(query, 3, stage);
+  sqlite3_bind_int(query, 4, parameter);
+  sqlite3_bind_int64(query, 5, PARTIAL_MD5_SIZE);
+  sqlite3_bind_int64(query, 6, (sqlite3_int64) entry->inode);
+  sqlite3_bind_int64(query, 7, entry->size);
+  sqlite3_bind_int64(query, 8, (sqlite3_int64) entry->ctime);
+  sqlite3_bind_int64(query, 9, (sqlite3_int64) entry->mtime);
+  sqlite3_bind_int64(query, 10, entry->ctime_nsec);
+  sqlite3_bind_int64(query, 11, entry->mtime_nsec);
+
+  return 1;
+}
+
+/* Load the digest of an intermediate matching stage, identified by its
+   kind and parameter (e.g. number of samples). */
+static int hashdb__loadstage(sqlite3 *db, const file_t *entry, int stage, int parameter, md5_byte_t **hash)
+{
+  int result;
+
+  if (!hashdb__bindstage(db, query_loadstage, entry, stage, parameter, 1))
+    return 0;
+
+  sqlite3_bind_int(query_loadstage, 12, hashfunction);
+
+  result = sqlite3_step(query_loadstage);
+
+  if (result != SQLITE_ROW || sqlite3_column_bytes(query_loadstage, 0) != HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
+  {
+    sqlite3_reset(query_loadstage);
+    return 0;
+  }
+
+  *hash = (md5_byte_t*) malloc(HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t));
+  if (*hash == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  md5copy(*hash, sqlite3_column_blob(query_loadstage, 0));
+
+  sqlite3_reset(query_loadstage);
+
+  return 1;
+}
+
+int hashdb_loadstage(sqlite3 *db, const file_t *entry, int stage, int parameter, md5_byte_t **hash)
+{
+  int result;
+
+  HASHDB_LOCK();
+  result = hashdb__loadstage(db, entry, stage, parameter, hash);
+  HASHDB_UNLOCK();
+
+  return result;
+}
+
+static int hashdb__savestage(sqlite3 *db, const file_t *entry, int stage, int parameter, const md5_byte_t *hash)
+{
+  int result;
+
+  if (!hashdb__bindstage(db, query_savestage, entry, stage, parameter, 0))
+    return 0;
+
+  sqlite3_bind_blob(query_savestage, 12, hash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
+  sqlite3_bind_int(query_savestage, 13, hashfunction);
+  sqlite3_bind_int64(query_savestage, 14, (sqlite3_int64) entry->device);
+
+  result = sqlite3_step(query_savestage);
+
+  sqlite3_reset(query_savestage);
+
+  return result == SQLITE_DONE;
+}
+
+int hashdb_savestage(sqlite3 *db, const file_t *entry, int stage, int parameter, md5_byte_t *hash)
+{
+#ifndef NO_THREADS
+  struct hashdb_write write;
+
+  if (hashdb_writer.running)
+  {
+    write.entry = entry;
+    write.kind = HASHDB_WRITE_STAGE;
+    write.stage = stage;
+    write.parameter = parameter;
+    md5copy(write.hash, hash);
+
+    return hashdb__queuewrite(&write);
+  }
+#endif
+
+  return hashdb__savestage(db, entry, stage, parameter, hash);
+}
+
+/* Bind the first eight parameters of a listing query: the directory's
+   id, its device, inode and times, and the scan options. */
+void hashdb__bindlisting(sqlite3_stmt *query, const struct directory *directory, const struct stat *status, const char *options)
+{
+  long ctime_nsec;
+  long mtime_nsec;
+
+#ifdef HAVE_NSEC_TIMES
+  ctime_nsec = status->st_ctim.tv_nsec;
+  mtime_nsec = status->st_mtim.tv_nsec;
+#else
+  ctime_nsec = 0;
+  mtime_nsec = 0;
+#endif
+
+  sqlite3_bind_int64(query, 1, directory->cacheid);
+  sqlite3_bind_int64(query, 2, (sqlite3_int64) status->st_dev);
+  sqlite3_bind_int64(query, 3, (sqlite3_int64) status->st_ino);
+  sqlite3_bind_int64(query, 4, (sqlite3_int64) status->st_ctime);
+  sqlite3_bind_int64(query, 5, (sqlite3_int64) status->st_mtime);
+  sqlite3_bind_int64(query, 6, ctime_nsec);
+  sqlite3_bind_int64(query, 7, mtime_nsec);
+  sqlite3_bind_text(query, 8, options, strlen(options), SQLITE_TRANSIENT);
+}
+
+/* Load what a directory held when last scanned, provided its status
+   and the scan options are unchanged since. The caller frees the
+   listing with listing_free(). Returns 0 if there is no such listing. */
+int hashdb_loadlisting(sqlite3 *db, struct directory *directory, const struct stat *status, const char *options, struct listing *listing)
+{
+  const void *data;
+  int size;
+  int result;
+
+  listing_init(listing);
+
+  if (directory->realpath == 0 || !hashdb__directoryid(db, directory, 0))
+    return 0;
+
+  hashdb__bindlisting(query_loadlisting, directory, status, options);
+
+  result = sqlite3_step(query_loadlisting);
+
+  if (result != SQLITE_ROW)
+  {
+    sqlite3_reset(query_loadlisting);
+    return 0;
+  }
+
+  data = sqlite3_column_blob(query_loadlisting, 0);
+  size = sqlite3_column_bytes(query_loadlisting, 0);
+
+  if (size > 0 && !listing_isvalid(data, size))
+  {
+    sqlite3_reset(query_loadlisting);
+    return 0;
+  }
+
+  if (size > 0)
+  {
+    listing->data = (char*) malloc(size);
+    if (listing->data == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    memcpy(listing->data, data, size);
+    listing->size = size;
+    listing->allocated = size;
+  }
+
+  sqlite3_reset(query_loadlisting);
+
+  return 1;
+}
+
+/* Record what a directory held when scanned, and its status beforehand. */
+int hashdb_savelisting(sqlite3 *db, struct directory *directory, const struct stat *status, const char *options, const struct listing *listing)
+{
+  int result;
+
+  if (directory->realpath == 0 || !hashdb__directoryid(db, directory, 1))
+    return 0;
+
+  hashdb__bindlisting(query_savelisting, directory, status, options);
+
+  if (listing->size > 0)
+    sqlite3_bind_blob(query_savelisting, 9, listing->data, listing->size, SQLITE_TRANSIENT);
+  else
+    sqlite3_bind_zeroblob(query_savelisting, 9, 0);
+
+  result = sqlite3_step(query_savelisting);
+
+  sqlite3_reset(query_savelisting);
+
+  return result == SQLITE_DONE;
+}
+
+#ifndef NO_THREADS
+/* Hand a write to the writer thread, waiting while its queue is full. */
+static int hashdb__queuewrite(const struct hashdb_write *write)
+{
+  pthread_mutex_lock(&hashdb_writer.mutex);
+
+  while (hashdb_writer.count == HASHDB_WRITER_BATCH)
+    pthread_cond_wait(&hashdb_writer.changed, &hashdb_writer.mutex);
+
+  hashdb_writer.queue[hashdb_writer.count++] = *write;
+
+  if (hashdb_writer.count == HASHDB_WRITER_BATCH)
+    pthread_cond_broadcast(&hashdb_writer.changed);
+
+  pthread_mutex_unlock(&hashdb_writer.mutex);
+
+  return 1;
+}
+
+/* Write queued batches as they fill, or sooner when asked to flush,
+   swapping queues so that callers may keep queueing meanwhile. */
+static void *hashdb__writer(void *arg)
+{
+  struct hashdb_write *batch;
+  struct hashdb_write *write;
+  size_t count;
+  time_t committed = time(0);
+
+  (void) arg;
+
+  pthread_mutex_lock(&hashdb_writer.mutex);
+
+  while (1)
+  {
+    while (hashdb_writer.count < HASHDB_WRITER_BATCH && !(hashdb_writer.flushing && hashdb_writer.count > 0) && !hashdb_writer.stopping)
+      pthread_cond_wait(&hashdb_writer.changed, &hashdb_writer.mutex);
+
+    if (hashdb_writer.count == 0 && hashdb_writer.stopping)
+      break;
+
+    batch = hashdb_writer.queue;
+    count = hashdb_writer.count;
+
+    hashdb_writer.queue = hashdb_writer.batch;
+    hashdb_writer.batch = batch;
+    hashdb_writer.count = 0;
+    hashdb_writer.writing = 1;
+
+    pthread_cond_broadcast(&hashdb_writer.changed);
+    pthread_mutex_unlock(&hashdb_writer.mutex);
+
+    pthread_mutex_lock(&hashdb_writer.database);
+
+    for (write = batch; write < batch + count; ++write)
+    {
+      if (write->kind == HASHDB_WRITE_HASHES)
+        hashdb__savehash(hashdb_writer.db, write->entry, write->hashes, write->partialhash, write->hash);
+      else
+        hashdb__savestage(hashdb_writer.db, write->entry, write->stage, write->parameter, write->hash);
+    }
+
+    if (time(0) - committed >= HASHDB_WRITER_INTERVAL)
+    {
+      hashdb_committransaction(hashdb_writer.db);
+      hashdb_begintransaction(hashdb_writer.db);
+      committed = time(0);
+    }
+
+    pthread_mutex_unlock(&hashdb_writer.database);
+
+    pthread_mutex_lock(&hashdb_writer.mutex);
+    hashdb_writer.writing = 0;
+    pthread_cond_broadcast(&hashdb_writer.changed);
+  }
+
+  pthread_mutex_unlock(&hashdb_writer.mutex);
+
+  return 0;
+}
+#endif
+
+/* Move hashdb_savehash() and hashdb_savestage() writes to a thread of
+   their own until hashdb_stopwriter(), so that callers need not wait on
+   the database. Must be called within a transaction, which the writer
+   commits and renews every HASHDB_WRITER_INTERVAL seconds and hands
+   back, still open, on stopping. Meanwhile only hashdb_loadhash(),
+   hashdb_loadstage() and hashdb_deletehashforpath() may otherwise be
+   used. Returns 0, and leaves writes synchronous, if no thread could be
+   started. */
+int hashdb_startwriter(sqlite3 *db)
+{
+#ifndef NO_THREADS
+  if (hashdb_writer.running)
+    return 1;
+
+  hashdb_writer.queue = (struct hashdb_write*) malloc(sizeof(struct hashdb_write) * HASHDB_WRITER_BATCH);
+  hashdb_writer.batch = (struct hashdb_write*) malloc(sizeof(struct hashdb_write) * HASHDB_WRITER_BATCH);
+  if (hashdb_writer.queue == 0 || hashdb_writer.batch == 0)
+  {
+    free(hashdb_writer.queue);
+    free(hashdb_writer.batch);
+    return 0;
+  }
+
+  hashdb_writer.db = db;
+  hashdb_writer.count = 0;
+  hashdb_writer.writing = 0;
+  hashdb_writer.flushing = 0;
+  hashdb_writer.stopping = 0;
+
+  pthread_mutex_init(&hashdb_writer.mutex, 0);
+  pthread_cond_init(&hashdb_writer.changed, 0);
+  pthread_mutex_init(&hashdb_writer.database, 0);
+
+  if (pthread_create(&hashdb_writer.thread, 0, hashdb__writer, 0) != 0)
+  {
+    pthread_mutex_destroy(&hashdb_writer.database);
+    pthread_cond_destroy(&hashdb_writer.changed);
+    pthread_mutex_destroy(&hashdb_writer.mutex);
+    free(hashdb_writer.queue);
+    free(hashdb_writer.batch);
+    return 0;
+  }
+
+  hashdb_writer.running = 1;
+
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* Wait for every queued write to reach the database and end the writer
+   thread, if running. */
+void hashdb_stopwriter(sqlite3 *db)
+{
+#ifndef NO_THREADS
+  if (!hashdb_writer.running)
+    return;
+
+  pthread_mutex_lock(&hashdb_writer.mutex);
+  hashdb_writer.stopping = 1;
+  pthread_cond_broadcast(&hashdb_writer.changed);
+  pthread_mutex_unlock(&hashdb_writer.mutex);
+
+  pthread_join(hashdb_writer.thread, 0);
+
+  hashdb_writer.running = 0;
+
+  pthread_mutex_destroy(&hashdb_writer.database);
+  pthread_cond_destroy(&hashdb_writer.changed);
+  pthread_mutex_destroy(&hashdb_writer.mutex);
+  free(hashdb_writer.queue);
+  free(hashdb_writer.batch);
+  hashdb_writer.queue = 0;
+  hashdb_writer.batch = 0;
+#endif
+}
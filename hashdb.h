@@ -24,6 +24,18 @@
 
 #include "fdupes.h"
 #include <sqlite3.h>
+#include <sys/stat.h>
+#include "listing.h"
+
+/* returned by hashdb_loadhash() for hashes cached under another path */
+#define HASHDB_FOUND_ELSEWHERE 2
+
+/* the cached hashes of one directory's files; see hashdb_preloaddirectory() */
+struct hashdb_preload
+{
+  struct hashdb_preloadrow *rows;
+  size_t count;
+};
 
 sqlite3 *hashdb_open(const char *path);
 int hashdb_close(sqlite3 *db);
@@ -36,10 +48,19 @@ int hashdb_savedirectory(sqlite3 *db, const char *path);
 int hashdb_deletedirectory(sqlite3 *db, sqlite3_int64 id);
 int hashdb_cleardirectories(sqlite3 *db);
 int hashdb_foreachdirectory(sqlite3 *db, const sqlite3_int64 *parentid, int (*callback)(const sqlite3_int64, const char*, const char*, const sqlite3_int64));
-int hashdb_loadhash(sqlite3 *db, const file_t *entry, md5_byte_t **partialhash, md5_byte_t **fullhash);
-int hashdb_savehash(sqlite3 *db, const file_t *entry, md5_byte_t *partialhash, md5_byte_t *fullhash);
+int hashdb_loadhash(sqlite3 *db, file_t *entry);
+int hashdb_savehash(sqlite3 *db, const file_t *entry);
+int hashdb_preloaddirectory(sqlite3 *db, struct directory *directory, struct hashdb_preload *preload);
+int hashdb_applypreload(const struct hashdb_preload *preload, file_t *entry);
+void hashdb_freepreload(struct hashdb_preload *preload);
 int hashdb_foreachhash(sqlite3 *db, sqlite3_int64 *directoryid, int (*callback)(const sqlite3_int64, const char*, const char*));
 int hashdb_deletehash(sqlite3 *db, sqlite3_int64 directoryid, const char *filename);
 int hashdb_deletehashforpath(sqlite3 *db, const char *path);
+int hashdb_loadstage(sqlite3 *db, const file_t *entry, int stage, int parameter, md5_byte_t **hash);
+int hashdb_savestage(sqlite3 *db, const file_t *entry, int stage, int parameter, md5_byte_t *hash);
+int hashdb_loadlisting(sqlite3 *db, struct directory *directory, const struct stat *status, const char *options, struct listing *listing);
+int hashdb_savelisting(sqlite3 *db, struct directory *directory, const struct stat *status, const char *options, const struct listing *listing);
+int hashdb_startwriter(sqlite3 *db);
+void hashdb_stopwriter(sqlite3 *db);
 
 #endif
\ No newline at end of file
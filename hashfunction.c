@@ -0,0 +1,154 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "hashfunction.h"
+#include "errormsg.h"
+
+/* hash function used for partial and full signatures */
+int hashfunction = HASH_FUNCTION_MD5;
+
+struct hashfunctioninfo
+{
+  int function;
+  const char *name;
+};
+
+static const struct hashfunctioninfo hashfunctions[] = {
+  { HASH_FUNCTION_MD5, "md5" },
+#ifdef HAVE_XXHASH
+  { HASH_FUNCTION_XXH128, "xxh128" },
+#endif
+#ifdef HAVE_BLAKE3
+  { HASH_FUNCTION_BLAKE3, "blake3" },
+#endif
+  { 0, 0 }
+};
+
+/* Return the identifier of the named hash function, or 0 if this build
+   does not support it. */
+int findhashfunction(const char *name)
+{
+  int x;
+
+  for (x = 0; hashfunctions[x].name != 0; ++x)
+    if (strcasecmp(hashfunctions[x].name, name) == 0)
+      return hashfunctions[x].function;
+
+  return 0;
+}
+
+const char *hashfunctionname(int function)
+{
+  int x;
+
+  for (x = 0; hashfunctions[x].name != 0; ++x)
+    if (hashfunctions[x].function == function)
+      return hashfunctions[x].name;
+
+  return 0;
+}
+
+/* Begin computing a digest using the selected hash function. Safe to
+   call from several threads at once, one state per thread. */
+void hash_init(struct hashstate *state)
+{
+  state->function = hashfunction;
+
+  switch (state->function)
+  {
+#ifdef HAVE_XXHASH
+  case HASH_FUNCTION_XXH128:
+    state->u.xxh3 = XXH3_createState();
+    if (state->u.xxh3 == NULL) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+    XXH3_128bits_reset(state->u.xxh3);
+    break;
+#endif
+
+#ifdef HAVE_BLAKE3
+  case HASH_FUNCTION_BLAKE3:
+    blake3_hasher_init(&state->u.blake3);
+    break;
+#endif
+
+  default:
+    md5_init(&state->u.md5);
+    break;
+  }
+}
+
+void hash_update(struct hashstate *state, const void *data, size_t size)
+{
+  switch (state->function)
+  {
+#ifdef HAVE_XXHASH
+  case HASH_FUNCTION_XXH128:
+    XXH3_128bits_update(state->u.xxh3, data, size);
+    break;
+#endif
+
+#ifdef HAVE_BLAKE3
+  case HASH_FUNCTION_BLAKE3:
+    blake3_hasher_update(&state->u.blake3, data, size);
+    break;
+#endif
+
+  default:
+    md5_append(&state->u.md5, (const md5_byte_t*) data, size);
+    break;
+  }
+}
+
+/* Write HASH_DIGEST_LENGTH bytes of digest and release the state. Must
+   be called exactly once for each call to hash_init(). */
+void hash_finish(struct hashstate *state, md5_byte_t *digest)
+{
+#ifdef HAVE_XXHASH
+  XXH128_canonical_t canonical;
+#endif
+
+  switch (state->function)
+  {
+#ifdef HAVE_XXHASH
+  case HASH_FUNCTION_XXH128:
+    XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state->u.xxh3));
+    memcpy(digest, canonical.digest, HASH_DIGEST_LENGTH);
+    XXH3_freeState(state->u.xxh3);
+    break;
+#endif
+
+#ifdef HAVE_BLAKE3
+  case HASH_FUNCTION_BLAKE3:
+    blake3_hasher_finalize(&state->u.blake3, digest, HASH_DIGEST_LENGTH);
+    break;
+#endif
+
+  default:
+    md5_finish(&state->u.md5, digest);
+    break;
+  }
+}
@@ -0,0 +1,66 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef HASHFUNCTION_H
+#define HASHFUNCTION_H
+
+#include <stddef.h>
+#include "md5/md5.h"
+#ifdef HAVE_XXHASH
+  #include <xxhash.h>
+#endif
+#ifdef HAVE_BLAKE3
+  #include <blake3.h>
+#endif
+
+/* identifiers stored in the hash database; never renumber these */
+#define HASH_FUNCTION_MD5 1
+#define HASH_FUNCTION_XXH128 2
+#define HASH_FUNCTION_BLAKE3 3
+
+/* every hash function produces (or is truncated to) a digest of this size */
+#define HASH_DIGEST_LENGTH 16
+
+struct hashstate
+{
+  int function;
+  union
+  {
+    md5_state_t md5;
+#ifdef HAVE_XXHASH
+    XXH3_state_t *xxh3;
+#endif
+#ifdef HAVE_BLAKE3
+    blake3_hasher blake3;
+#endif
+  } u;
+};
+
+extern int hashfunction;
+
+int findhashfunction(const char *name);
+const char *hashfunctionname(int function);
+
+void hash_init(struct hashstate *state);
+void hash_update(struct hashstate *state, const void *data, size_t size);
+void hash_finish(struct hashstate *state, md5_byte_t *digest);
+
+#endif
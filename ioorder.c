@@ -0,0 +1,127 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_FIEMAP_H
+  #include <sys/ioctl.h>
+  #include <linux/fs.h>
+  #include <linux/fiemap.h>
+#endif
+#include "ioorder.h"
+
+ioorder_t ioorder = IO_ORDER_NONE;
+
+#ifdef HAVE_LINUX_FIEMAP_H
+/* Find the physical byte offset of the first extent of a file. Returns
+   0 if the file system cannot tell. */
+static int physicaloffset(const char *path, unsigned long long *offset)
+{
+  union {
+    struct fiemap map;
+    char space[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+  } request;
+  int found = 0;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  memset(&request, 0, sizeof(request));
+  request.map.fm_start = 0;
+  request.map.fm_length = FIEMAP_MAX_OFFSET;
+  request.map.fm_extent_count = 1;
+
+  if (ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 &&
+      request.map.fm_mapped_extents == 1 &&
+      !(request.map.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+  {
+    *offset = request.map.fm_extents[0].fe_physical;
+    found = 1;
+  }
+
+  close(fd);
+
+  return found;
+}
+#endif
+
+/* Work out where a file lives on its device, for --io-order. With
+   'physical', this is the offset of its first extent if the file system
+   reports one, and its inode number otherwise. */
+void locatefile(file_t *file)
+{
+  if (file->locationtype != LOCATION_UNKNOWN)
+    return;
+
+#ifdef HAVE_LINUX_FIEMAP_H
+  if (ioorder == IO_ORDER_PHYSICAL && physicaloffset(file->d_name, &file->location)) {
+    file->locationtype = LOCATION_PHYSICAL;
+    return;
+  }
+#endif
+
+  file->location = file->inode;
+  file->locationtype = LOCATION_INODE;
+}
+
+/* Order files by device, then by location. Files located by physical
+   offset come before those located by inode number. */
+int comparelocations(file_t *a, file_t *b)
+{
+  locatefile(a);
+  locatefile(b);
+
+  if (a->device != b->device)
+    return a->device < b->device ? -1 : 1;
+
+  if (a->locationtype != b->locationtype)
+    return a->locationtype < b->locationtype ? -1 : 1;
+
+  if (a->location != b->location)
+    return a->location < b->location ? -1 : 1;
+
+  return strcmp(a->d_name, b->d_name);
+}
+
+static int sortbylocation__compare(const void *a, const void *b)
+{
+  return comparelocations(*(file_t**) a, *(file_t**) b);
+}
+
+/* Sort files into the order --io-order asks for them to be read in. */
+void sortbylocation(file_t **files, size_t count)
+{
+  size_t f;
+
+  if (ioorder == IO_ORDER_NONE)
+    return;
+
+  /* locate every file up front, rather than repeatedly while sorting */
+  for (f = 0; f < count; ++f)
+    locatefile(files[f]);
+
+  qsort(files, count, sizeof(file_t*), sortbylocation__compare);
+}
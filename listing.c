@@ -0,0 +1,164 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "listing.h"
+#include "errormsg.h"
+
+/* Each entry is a kind byte, a byte that is 1 for entries reached
+   through a symbolic link, and the entry's NUL-terminated name. File
+   entries go on with their status, as LISTING_FIELDS 64-bit integers
+   in host byte order. */
+#define LISTING_FILE 'f'
+#define LISTING_DIRECTORY 'd'
+
+#define LISTING_FIELDS 7
+
+void listing_init(struct listing *listing)
+{
+  listing->data = 0;
+  listing->size = 0;
+  listing->allocated = 0;
+}
+
+static void listing__append(struct listing *listing, const void *data, size_t size)
+{
+  char *newdata;
+
+  if (listing->size + size > listing->allocated)
+  {
+    listing->allocated = listing->allocated ? listing->allocated * 2 : 4096;
+    while (listing->size + size > listing->allocated)
+      listing->allocated *= 2;
+
+    newdata = (char*) realloc(listing->data, listing->allocated);
+    if (newdata == 0)
+    {
+      errormsg("out of memory!\n");
+      exit(1);
+    }
+
+    listing->data = newdata;
+  }
+
+  memcpy(listing->data + listing->size, data, size);
+  listing->size += size;
+}
+
+static void listing__appendheader(struct listing *listing, char kind, int islink, const char *name)
+{
+  char header[2];
+
+  header[0] = kind;
+  header[1] = islink ? 1 : 0;
+
+  listing__append(listing, header, sizeof(header));
+  listing__append(listing, name, strlen(name) + 1);
+}
+
+void listing_addfile(struct listing *listing, const file_t *file)
+{
+  long long fields[LISTING_FIELDS];
+
+  fields[0] = file->device;
+  fields[1] = file->inode;
+  fields[2] = file->size;
+  fields[3] = file->mtime;
+  fields[4] = file->ctime;
+  fields[5] = file->mtime_nsec;
+  fields[6] = file->ctime_nsec;
+
+  listing__appendheader(listing, LISTING_FILE, file->islink, file->name);
+  listing__append(listing, fields, sizeof(fields));
+}
+
+void listing_adddirectory(struct listing *listing, const char *name, int islink)
+{
+  listing__appendheader(listing, LISTING_DIRECTORY, islink, name);
+}
+
+/* Read the entry at *offset in a listing's data and advance *offset
+   past it. Returns 1 if an entry was read, 0 at the end of the data,
+   or -1 if the data is malformed. */
+int listing_next(const char *data, size_t size, size_t *offset, struct listingentry *entry)
+{
+  long long fields[LISTING_FIELDS];
+  const char *end;
+  size_t at = *offset;
+
+  if (at == size)
+    return 0;
+
+  if (size - at < 3 || (data[at] != LISTING_FILE && data[at] != LISTING_DIRECTORY))
+    return -1;
+
+  entry->isdirectory = data[at] == LISTING_DIRECTORY;
+  entry->islink = data[at + 1];
+  entry->name = data + at + 2;
+
+  end = memchr(entry->name, '\0', size - at - 2);
+  if (end == 0)
+    return -1;
+
+  at = end + 1 - data;
+
+  if (!entry->isdirectory)
+  {
+    if (size - at < sizeof(fields))
+      return -1;
+
+    memcpy(fields, data + at, sizeof(fields));
+    at += sizeof(fields);
+
+    entry->device = fields[0];
+    entry->inode = fields[1];
+    entry->size = fields[2];
+    entry->mtime = fields[3];
+    entry->ctime = fields[4];
+    entry->mtime_nsec = fields[5];
+    entry->ctime_nsec = fields[6];
+  }
+
+  *offset = at;
+
+  return 1;
+}
+
+/* check that every entry of a listing's data can be read */
+int listing_isvalid(const char *data, size_t size)
+{
+  struct listingentry entry;
+  size_t offset = 0;
+  int result;
+
+  while ((result = listing_next(data, size, &offset, &entry)) == 1)
+    ;
+
+  return result == 0;
+}
+
+void listing_free(struct listing *listing)
+{
+  free(listing->data);
+  listing_init(listing);
+}
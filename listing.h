@@ -0,0 +1,61 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LISTING_H
+#define LISTING_H
+
+#include "fdupes.h"
+
+/* What a scan of one directory kept, in the order found: its files,
+   with the status stat() returned for them, and the subdirectories
+   descended into. Stored in the hash database so that an unchanged
+   directory can be rescanned without being read; see
+   hashdb_savelisting(). */
+struct listing
+{
+  char *data;
+  size_t size;
+  size_t allocated;
+};
+
+/* one entry of a listing, as returned by listing_next() */
+struct listingentry
+{
+  int isdirectory;
+  int islink;
+  const char *name; /* points into the listing's data */
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  time_t mtime;
+  time_t ctime;
+  long mtime_nsec;
+  long ctime_nsec;
+};
+
+void listing_init(struct listing *listing);
+void listing_addfile(struct listing *listing, const file_t *file);
+void listing_adddirectory(struct listing *listing, const char *name, int islink);
+int listing_next(const char *data, size_t size, size_t *offset, struct listingentry *entry);
+int listing_isvalid(const char *data, size_t size);
+void listing_free(struct listing *listing);
+
+#endif
@@ -66,6 +66,7 @@ struct log_info *log_open(char *filename, int *error)
 
   info->log_start = 1;
   info->deleted = 0;
+  info->linked = 0;
   info->remaining = 0;
 
   if (error != 0)
@@ -74,7 +75,7 @@ struct log_info *log_open(char *filename, int *error)
   return info;
 }
 
-/* Free linked lists holding set of deleted and remaining files.
+/* Free linked lists holding set of deleted, linked and remaining files.
 */
 void log_free_set(struct log_info *info)
 {
@@ -91,6 +92,16 @@ void log_free_set(struct log_info *info)
     f = next;
   }
 
+  f = info->linked;
+  while (f != 0)
+  {
+    next = f->next;
+
+    free(f);
+
+    f = next;
+  }
+
   f = info->remaining;
   while (f != 0)
   {
@@ -102,6 +113,7 @@ void log_free_set(struct log_info *info)
   }
 
   info->deleted = 0;
+  info->linked = 0;
   info->remaining = 0;
 }
 
@@ -130,6 +142,24 @@ int log_file_deleted(struct log_info *info, char *name)
   return 1;
 }
 
+/* Add file replaced with a hard link to log.
+*/
+int log_file_linked(struct log_info *info, char *name)
+{
+  struct log_file *file;
+
+  file = (struct log_file*) malloc(sizeof(struct log_file));
+  if (file == 0)
+    return 0;
+
+  file->next = info->linked;
+  file->filename = name;
+
+  info->linked = file;
+
+  return 1;
+}
+
 /* Add remaining file to log.
 */
 int log_file_remaining(struct log_info *info, char *name)
@@ -182,7 +212,7 @@ void log_end_set(struct log_info *info)
 {
   struct log_file *f;
 
-  if (info->deleted == 0)
+  if (info->deleted == 0 && info->linked == 0)
     return;
 
   if (info->log_start)
@@ -199,11 +229,18 @@ void log_end_set(struct log_info *info)
   }
 
   f = info->deleted;
-  do
+  while (f != 0)
   {
     fprintf(info->file, "deleted %s\n", f->filename);
     f = f->next;
-  } while (f != 0);
+  }
+
+  f = info->linked;
+  while (f != 0)
+  {
+    fprintf(info->file, " linked %s\n", f->filename);
+    f = f->next;
+  }
 
   f = info->remaining;
   while (f != 0)
@@ -0,0 +1,291 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <string.h>
+#include <strings.h>
+#include "matchwriter.h"
+#include "hashfunction.h"
+
+int outputformat = FORMAT_TEXT;
+
+static FILE *matchwriter__stream;
+static char matchwriter__buffer[MATCHWRITER_BUFFER_SIZE];
+static size_t matchwriter__used;
+static size_t matchwriter__sets;
+
+/* Look up an output format by name. Returns -1 if there is none. */
+int findoutputformat(const char *name)
+{
+  if (!strcasecmp(name, "text"))
+    return FORMAT_TEXT;
+  if (!strcasecmp(name, "json"))
+    return FORMAT_JSON;
+  if (!strcasecmp(name, "ndjson"))
+    return FORMAT_NDJSON;
+  if (!strcasecmp(name, "null"))
+    return FORMAT_NULL;
+
+  return -1;
+}
+
+static void matchwriter__flush(void)
+{
+  fwrite(matchwriter__buffer, 1, matchwriter__used, matchwriter__stream);
+  matchwriter__used = 0;
+}
+
+static void matchwriter__write(const char *data, size_t length)
+{
+  size_t room;
+
+  while (length > 0)
+  {
+    if (matchwriter__used == MATCHWRITER_BUFFER_SIZE)
+      matchwriter__flush();
+
+    room = MATCHWRITER_BUFFER_SIZE - matchwriter__used;
+    if (room > length)
+      room = length;
+
+    memcpy(matchwriter__buffer + matchwriter__used, data, room);
+    matchwriter__used += room;
+    data += room;
+    length -= room;
+  }
+}
+
+static void matchwriter__puts(const char *s)
+{
+  matchwriter__write(s, strlen(s));
+}
+
+static void matchwriter__putnumber(unsigned long long n)
+{
+  char digits[24];
+  size_t d = sizeof(digits);
+
+  do
+  {
+    digits[--d] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+
+  matchwriter__write(digits + d, sizeof(digits) - d);
+}
+
+/* Length of the valid UTF-8 sequence starting at s, or 0 if s does not
+   start one. */
+static size_t matchwriter__utf8length(const unsigned char *s)
+{
+  size_t length;
+  size_t i;
+  unsigned long c;
+
+  if (s[0] < 0x80)
+    return 1;
+  else if ((s[0] & 0xe0) == 0xc0)
+    length = 2, c = s[0] & 0x1f;
+  else if ((s[0] & 0xf0) == 0xe0)
+    length = 3, c = s[0] & 0x0f;
+  else if ((s[0] & 0xf8) == 0xf0)
+    length = 4, c = s[0] & 0x07;
+  else
+    return 0;
+
+  for (i = 1; i < length; ++i)
+  {
+    if ((s[i] & 0xc0) != 0x80)
+      return 0;
+
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+
+  /* reject overlong forms, surrogates and code points beyond Unicode */
+  if ((length == 2 && c < 0x80) || (length == 3 && c < 0x800) || (length == 4 && c < 0x10000) ||
+      (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+    return 0;
+
+  return length;
+}
+
+/* Write a file name as a JSON string. Bytes that are not part of valid
+   UTF-8 are written as the lone surrogates U+DC80 to U+DCFF (as with
+   Python's "surrogateescape"), so that any name can be recovered
+   exactly. */
+static void matchwriter__putstring(const char *name)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *s = (const unsigned char *) name;
+  const unsigned char *run = s;
+  char escape[7];
+  size_t length;
+
+  matchwriter__write("\"", 1);
+
+  while (*s != '\0')
+  {
+    length = matchwriter__utf8length(s);
+
+    if (length > 0 && *s >= 0x20 && *s != '"' && *s != '\\')
+    {
+      s += length;
+      continue;
+    }
+
+    matchwriter__write((const char *) run, s - run);
+
+    if (*s == '"' || *s == '\\')
+    {
+      escape[0] = '\\';
+      escape[1] = *s;
+      matchwriter__write(escape, 2);
+    }
+    else
+    {
+      escape[0] = '\\';
+      escape[1] = 'u';
+      escape[2] = length > 0 ? '0' : 'd';
+      escape[3] = length > 0 ? '0' : 'c';
+      escape[4] = hex[*s >> 4];
+      escape[5] = hex[*s & 0xf];
+      matchwriter__write(escape, 6);
+    }
+
+    run = ++s;
+  }
+
+  matchwriter__write((const char *) run, s - run);
+  matchwriter__write("\"", 1);
+}
+
+static void matchwriter__putdigest(const md5_byte_t *digest)
+{
+  static const char hex[] = "0123456789abcdef";
+  char text[HASH_DIGEST_LENGTH * 2 + 2];
+  int i;
+
+  if (digest == 0)
+  {
+    matchwriter__puts("null");
+    return;
+  }
+
+  text[0] = '"';
+  for (i = 0; i < HASH_DIGEST_LENGTH; ++i)
+  {
+    text[1 + i * 2] = hex[digest[i] >> 4];
+    text[2 + i * 2] = hex[digest[i] & 0xf];
+  }
+  matchwriter__write(text, 1 + HASH_DIGEST_LENGTH * 2);
+  matchwriter__write("\"", 1);
+}
+
+static void matchwriter__putfile(const file_t *file)
+{
+  matchwriter__puts("{\"path\":");
+  matchwriter__putstring(file->d_name);
+  matchwriter__puts(",\"device\":");
+  matchwriter__putnumber(file->device);
+  matchwriter__puts(",\"inode\":");
+  matchwriter__putnumber(file->inode);
+  matchwriter__puts(",\"mtime\":");
+  if (file->mtime < 0)
+  {
+    matchwriter__write("-", 1);
+    matchwriter__putnumber(-(long long) file->mtime);
+  }
+  else
+    matchwriter__putnumber(file->mtime);
+  matchwriter__write("}", 1);
+}
+
+/* Start writing sets of duplicates to stream in outputformat. */
+void matchwriter_begin(FILE *stream)
+{
+  matchwriter__stream = stream;
+  matchwriter__used = 0;
+  matchwriter__sets = 0;
+
+  if (outputformat == FORMAT_JSON)
+    matchwriter__write("[", 1);
+}
+
+/* Write the set of duplicates starting with first. In ndjson and null
+   formats each set is flushed as soon as it is written, so that readers
+   can act on it while matching goes on. */
+void matchwriter_set(const file_t *first)
+{
+  const file_t *file;
+
+  if (outputformat == FORMAT_NULL)
+  {
+    for (file = first; file != 0; file = file->duplicates)
+      matchwriter__write(file->d_name, strlen(file->d_name) + 1);
+
+    /* an empty name ends the set */
+    matchwriter__write("", 1);
+  }
+  else
+  {
+    if (outputformat == FORMAT_JSON && matchwriter__sets > 0)
+      matchwriter__write(",", 1);
+
+    matchwriter__puts(outputformat == FORMAT_JSON ? "\n{\"size\":" : "{\"size\":");
+    matchwriter__putnumber(first->size);
+    matchwriter__puts(",\"hash\":\"");
+    matchwriter__puts(hashfunctionname(hashfunction));
+    matchwriter__puts("\",\"digest\":");
+    matchwriter__putdigest(HASSIGNATURE(first) ? first->crcsignature : 0);
+    matchwriter__puts(",\"files\":[");
+
+    for (file = first; file != 0; file = file->duplicates)
+    {
+      if (file != first)
+        matchwriter__write(",", 1);
+
+      matchwriter__putfile(file);
+    }
+
+    matchwriter__puts("]}");
+
+    if (outputformat == FORMAT_NDJSON)
+      matchwriter__write("\n", 1);
+  }
+
+  ++matchwriter__sets;
+
+  if (outputformat != FORMAT_JSON)
+  {
+    matchwriter__flush();
+    fflush(matchwriter__stream);
+  }
+}
+
+/* Finish writing sets of duplicates. */
+void matchwriter_end(void)
+{
+  if (outputformat == FORMAT_JSON)
+    matchwriter__puts(matchwriter__sets > 0 ? "\n]\n" : "]\n");
+
+  matchwriter__flush();
+  fflush(matchwriter__stream);
+}
@@ -0,0 +1,43 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef MATCHWRITER_H
+#define MATCHWRITER_H
+
+#include <stdio.h>
+#include "fdupes.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_NDJSON 2
+#define FORMAT_NULL 3
+
+/* size of the buffer sets are written through */
+#define MATCHWRITER_BUFFER_SIZE 65536
+
+extern int outputformat;
+
+int findoutputformat(const char *name);
+void matchwriter_begin(FILE *stream);
+void matchwriter_set(const file_t *first);
+void matchwriter_end(void);
+
+#endif
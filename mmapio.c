@@ -0,0 +1,194 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <string.h>
+#include "mmapio.h"
+#include "sigint.h"
+
+#ifndef NO_THREADS
+  #define MMAPIO_THREAD_LOCAL __thread
+#else
+  #define MMAPIO_THREAD_LOCAL
+#endif
+
+/* Where to return to if touching a mapped page raises SIGBUS (as happens
+   when the file is truncated while mapped). SIGBUS is delivered to the
+   thread that caused it, so each thread keeps its own. */
+static MMAPIO_THREAD_LOCAL sigjmp_buf *volatile mmapio__fault = 0;
+
+static void mmapio__sigbus(int signum)
+{
+  if (mmapio__fault != 0)
+    siglongjmp(*mmapio__fault, 1);
+
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+/* Install the SIGBUS handler. Call once, before any other thread
+   starts. */
+void mmapio_init()
+{
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = mmapio__sigbus;
+  sigemptyset(&action.sa_mask);
+
+  sigaction(SIGBUS, &action, 0);
+}
+
+/* Map length bytes of a file, starting at offset, for reading it
+   sequentially. Returns 0 if the file cannot be mapped. */
+unsigned char *mmapio_map(int fd, off_t offset, size_t length)
+{
+  void *map;
+
+  map = mmap(0, length, PROT_READ, MAP_SHARED, fd, offset);
+  if (map == MAP_FAILED)
+    return 0;
+
+  posix_madvise(map, length, POSIX_MADV_SEQUENTIAL);
+
+  return (unsigned char *) map;
+}
+
+void mmapio_unmap(unsigned char *map, size_t length)
+{
+  munmap(map, length);
+}
+
+/* Compare two windows of length bytes, either of which may be mapped.
+   Returns 1 if they are identical, or 0 if they differ or a mapped
+   file is truncated while being compared. */
+int mmapio_equal(const unsigned char *window1, const unsigned char *window2, size_t length)
+{
+  sigjmp_buf fault;
+  int equal;
+
+  if (sigsetjmp(fault, 1) != 0) {
+    mmapio__fault = 0;
+    return 0;
+  }
+
+  mmapio__fault = &fault;
+  equal = memcmp(window1, window2, length) == 0;
+  mmapio__fault = 0;
+
+  return equal;
+}
+
+/* Hash the first size bytes of a file straight from the page cache,
+   MMAP_WINDOW_SIZE bytes at a time. Returns 0 on success, or -1 if the
+   file cannot be mapped, becomes shorter than size while being read,
+   or the user interrupts. */
+int mmapio_hash(int fd, off_t size, struct hashstate *state)
+{
+  sigjmp_buf fault;
+  unsigned char *volatile map = 0;
+  volatile size_t length = 0;
+  volatile off_t offset = 0;
+
+  if (sigsetjmp(fault, 1) != 0) {
+    mmapio__fault = 0;
+    munmap(map, length);
+    return -1;
+  }
+
+  while (offset < size && !got_sigint) {
+    length = size - offset > MMAP_WINDOW_SIZE ? MMAP_WINDOW_SIZE : size - offset;
+
+    map = mmapio_map(fd, offset, length);
+    if (map == 0)
+      return -1;
+
+    mmapio__fault = &fault;
+    hash_update(state, map, length);
+    mmapio__fault = 0;
+
+    munmap(map, length);
+
+    offset += length;
+  }
+
+  return got_sigint ? -1 : 0;
+}
+
+/* Compare the contents of two files straight from the page cache.
+   Returns 1 if they are identical, 0 if they differ (or either one is
+   truncated while being compared), or -1 if they cannot be mapped. */
+int mmapio_compare(int fd1, int fd2)
+{
+  struct stat info1;
+  struct stat info2;
+  sigjmp_buf fault;
+  unsigned char *volatile map1 = 0;
+  unsigned char *volatile map2 = 0;
+  volatile size_t length = 0;
+  volatile off_t offset = 0;
+  int differ;
+
+  if (fstat(fd1, &info1) != 0 || fstat(fd2, &info2) != 0)
+    return -1;
+
+  if (info1.st_size != info2.st_size)
+    return 0;
+
+  if (sigsetjmp(fault, 1) != 0) {
+    mmapio__fault = 0;
+    munmap(map1, length);
+    munmap(map2, length);
+    return 0;
+  }
+
+  while (offset < info1.st_size && !got_sigint) {
+    length = info1.st_size - offset > MMAP_WINDOW_SIZE ? MMAP_WINDOW_SIZE : info1.st_size - offset;
+
+    map1 = mmapio_map(fd1, offset, length);
+    if (map1 == 0)
+      return -1;
+
+    map2 = mmapio_map(fd2, offset, length);
+    if (map2 == 0) {
+      munmap(map1, length);
+      return -1;
+    }
+
+    mmapio__fault = &fault;
+    differ = memcmp(map1, map2, length);
+    mmapio__fault = 0;
+
+    munmap(map1, length);
+    munmap(map2, length);
+
+    if (differ)
+      return 0;
+
+    offset += length;
+  }
+
+  return got_sigint ? -1 : 1;
+}
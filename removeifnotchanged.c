@@ -25,17 +25,15 @@
 #include <string.h>
 #include <stdio.h>
 
-int removeifnotchanged(const file_t *file, char **errorstring)
+/* Check whether a file has changed since it was examined. */
+int filechanged(const file_t *file)
 {
-  int result;
   struct stat st;
 
-  static char *filechanged = "File contents changed during processing";
-  static char *unknownerror = "Unknown error";
-
-  stat(file->d_name, &st);
+  if (stat(file->d_name, &st) != 0)
+    return 1;
 
-  if (file->device != st.st_dev ||
+  return file->device != st.st_dev ||
       file->inode != st.st_ino ||
       file->ctime != st.st_ctime ||
       file->mtime != st.st_mtime ||
@@ -43,10 +41,19 @@ int removeifnotchanged(const file_t *file, char **errorstring)
       file->ctime_nsec != st.st_ctim.tv_nsec ||
       file->mtime_nsec != st.st_mtim.tv_nsec ||
 #endif
-      file->size != st.st_size)
+      file->size != st.st_size;
+}
+
+int removeifnotchanged(const file_t *file, char **errorstring)
+{
+  int result;
+
+  static char *unknownerror = "Unknown error";
+
+  if (filechanged(file))
   {
     if (errorstring != 0)
-        *errorstring = filechanged;
+        *errorstring = FILE_CHANGED_ERROR;
 
     return -2;
   }
@@ -24,6 +24,9 @@
 
 #include "fdupes.h"
 
+#define FILE_CHANGED_ERROR "File contents changed during processing"
+
+int filechanged(const file_t *file);
 int removeifnotchanged(const file_t *file, char **errorstring);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,100 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "sizegroup.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES ((sizeof(off_t) * 8 + RADIX_BITS - 1) / RADIX_BITS)
+
+/* Return an array holding every file in the list, ordered by size.
+   Files of equal size keep their relative list order, so each run of
+   equal sizes can be matched exactly as if it were the whole list.
+   The number of files is stored in *count. Returns 0 if out of memory. */
+
+file_t **groupbysize(file_t *files, size_t *count)
+{
+  file_t **sorted;
+  file_t **scratch;
+  file_t **swap;
+  file_t *curfile;
+  size_t histogram[RADIX_BUCKETS];
+  size_t offset;
+  size_t total;
+  size_t n;
+  size_t x;
+  unsigned int pass;
+  unsigned int digit;
+
+  n = 0;
+  for (curfile = files; curfile != 0; curfile = curfile->next)
+    ++n;
+
+  *count = n;
+
+  sorted = (file_t**) malloc(sizeof(file_t*) * (n + 1));
+  scratch = (file_t**) malloc(sizeof(file_t*) * (n + 1));
+  if (sorted == 0 || scratch == 0) {
+    free(sorted);
+    free(scratch);
+    return 0;
+  }
+
+  x = 0;
+  for (curfile = files; curfile != 0; curfile = curfile->next)
+    sorted[x++] = curfile;
+
+  /* least-significant-digit radix sort; stable by construction */
+  for (pass = 0; pass < RADIX_PASSES; ++pass) {
+    memset(histogram, 0, sizeof(histogram));
+
+    for (x = 0; x < n; ++x)
+      ++histogram[((unsigned long long) sorted[x]->size >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)];
+
+    /* skip passes where every size shares the same digit */
+    digit = ((unsigned long long) (n > 0 ? sorted[0]->size : 0) >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+    if (histogram[digit] == n)
+      continue;
+
+    total = 0;
+    for (x = 0; x < RADIX_BUCKETS; ++x) {
+      offset = histogram[x];
+      histogram[x] = total;
+      total += offset;
+    }
+
+    for (x = 0; x < n; ++x)
+      scratch[histogram[((unsigned long long) sorted[x]->size >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++] = sorted[x];
+
+    swap = sorted;
+    sorted = scratch;
+    scratch = swap;
+  }
+
+  free(scratch);
+
+  sorted[n] = 0;
+
+  return sorted;
+}
@@ -0,0 +1,131 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "stages.h"
+
+struct stage stages[MAX_STAGES];
+int stagecount = 0;
+
+/* Parse a comma-separated list of stages such as "tail,sample:16".
+   Returns 0 if the list is invalid. */
+int parsestages(const char *list)
+{
+  char *copy;
+  char *token;
+  char *endptr;
+  long samples;
+  int kind;
+  int s;
+
+  copy = strdup(list);
+  if (copy == 0)
+    return 0;
+
+  stagecount = 0;
+
+  for (token = strtok(copy, ","); token != 0; token = strtok(0, ","))
+  {
+    samples = STAGE_DEFAULT_SAMPLES;
+
+    if (strcasecmp(token, "tail") == 0)
+    {
+      kind = STAGE_TAIL;
+      samples = 0;
+    }
+    else if (strncasecmp(token, "sample", 6) == 0 && (token[6] == '\0' || token[6] == ':'))
+    {
+      kind = STAGE_SAMPLE;
+
+      if (token[6] == ':')
+      {
+        samples = strtol(token + 7, &endptr, 10);
+        if (token[7] == '\0' || *endptr != '\0' || samples < 1 || samples > STAGE_MAX_SAMPLES)
+        {
+          free(copy);
+          return 0;
+        }
+      }
+    }
+    else
+    {
+      free(copy);
+      return 0;
+    }
+
+    /* each stage may appear only once */
+    for (s = 0; s < stagecount; ++s)
+      if (stages[s].kind == kind)
+        break;
+
+    if (s < stagecount || stagecount == MAX_STAGES)
+    {
+      free(copy);
+      return 0;
+    }
+
+    stages[stagecount].kind = kind;
+    stages[stagecount].samples = samples;
+    ++stagecount;
+  }
+
+  free(copy);
+
+  return 1;
+}
+
+const char *stagename(const struct stage *stage)
+{
+  return stage->kind == STAGE_TAIL ? "tail" : "sample";
+}
+
+/* A stage is skipped for files small enough that it would read most
+   of what the partial signature has not already covered. */
+int stageapplies(const struct stage *stage, off_t size)
+{
+  if (stage->kind == STAGE_TAIL)
+    return size > 2 * PARTIAL_MD5_SIZE;
+  else
+    return size > 4 * (off_t) (stage->samples + 2) * PARTIAL_MD5_SIZE;
+}
+
+/* Fill offsets with the start of each PARTIAL_MD5_SIZE block a stage
+   reads from a file of the given size, and return the number of
+   blocks. Offsets must have room for STAGE_MAX_SAMPLES entries. */
+size_t stageblocks(const struct stage *stage, off_t size, off_t *offsets)
+{
+  int b;
+
+  if (stage->kind == STAGE_TAIL)
+  {
+    offsets[0] = size - PARTIAL_MD5_SIZE;
+    return 1;
+  }
+
+  /* spread blocks evenly between the head and tail */
+  for (b = 0; b < stage->samples; ++b)
+    offsets[b] = (size / (stage->samples + 1) * (b + 1)) / PARTIAL_MD5_SIZE * PARTIAL_MD5_SIZE;
+
+  return stage->samples;
+}
@@ -0,0 +1,50 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef STAGES_H
+#define STAGES_H
+
+#include <sys/types.h>
+#include "fdupes.h"
+
+/* intermediate matching stages, run between the partial (head) and
+   full signatures */
+#define STAGE_TAIL 1
+#define STAGE_SAMPLE 2
+
+#define STAGE_DEFAULT_SAMPLES 8
+#define STAGE_MAX_SAMPLES 64
+
+struct stage
+{
+  int kind;
+  int samples; /* number of blocks read by STAGE_SAMPLE */
+};
+
+extern struct stage stages[MAX_STAGES];
+extern int stagecount;
+
+int parsestages(const char *list);
+const char *stagename(const struct stage *stage);
+int stageapplies(const struct stage *stage, off_t size);
+size_t stageblocks(const struct stage *stage, off_t size, off_t *offsets);
+
+#endif
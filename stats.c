@@ -0,0 +1,73 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
+#include "stats.h"
+
+struct scanstats stats;
+
+#ifndef NO_THREADS
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* add to a counter that may also be updated by worker threads */
+void stats_add(unsigned long long *counter, unsigned long long amount)
+{
+#ifndef NO_THREADS
+  pthread_mutex_lock(&stats_mutex);
+#endif
+
+  *counter += amount;
+
+#ifndef NO_THREADS
+  pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+void printstats(FILE *stream)
+{
+  char label[32];
+  int s;
+
+  fprintf(stream, "directory entries:      %llu\n", stats.entries);
+  fprintf(stream, "stat calls on entries:  %llu", stats.metadatacalls);
+  if (stats.entries > 0)
+    fprintf(stream, " (%.2f per entry)", (double) stats.metadatacalls / (double) stats.entries);
+  fprintf(stream, "\n");
+  fprintf(stream, "files considered:       %llu\n", stats.files);
+  fprintf(stream, "distinct file sizes:    %llu\n", stats.sizeclasses);
+  fprintf(stream, "unique-size files:      %llu\n", stats.singletons);
+  fprintf(stream, "files opened (hashing): %llu\n", stats.opens);
+  fprintf(stream, "bytes read (hashing):   %llu\n", stats.bytesread);
+  fprintf(stream, "bytes read (comparing): %llu\n", stats.comparebytes);
+  fprintf(stream, "signatures borrowed:    %llu\n", stats.borrowed);
+
+  for (s = 0; s < stats.stages; ++s) {
+    snprintf(label, sizeof(label), "stage %s:", stats.stagenames[s]);
+    fprintf(stream, "%-23s %llu files", label, stats.stagefiles[s]);
+    if (s + 1 < stats.stages)
+      fprintf(stream, ", %llu eliminated", stats.stagefiles[s] - stats.stagefiles[s + 1]);
+    fprintf(stream, "\n");
+  }
+}
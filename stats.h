@@ -0,0 +1,51 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* head, up to two intermediate stages, and full */
+#define STATS_MAX_STAGES 4
+
+struct scanstats
+{
+  unsigned long long entries;      /* directory entries examined */
+  unsigned long long metadatacalls; /* stat() and lstat() calls made on entries */
+  unsigned long long files;        /* files considered for matching */
+  unsigned long long sizeclasses;  /* distinct file sizes */
+  unsigned long long singletons;   /* files discarded for having a unique size */
+  unsigned long long opens;        /* files opened for hashing */
+  unsigned long long bytesread;    /* bytes read while hashing */
+  unsigned long long comparebytes; /* bytes read while confirming matches */
+  unsigned long long borrowed;     /* full signatures borrowed rather than computed */
+  unsigned long long stagefiles[STATS_MAX_STAGES]; /* files reaching each matching stage */
+  const char *stagenames[STATS_MAX_STAGES];
+  int stages;
+};
+
+extern struct scanstats stats;
+
+void stats_add(unsigned long long *counter, unsigned long long amount);
+void printstats(FILE *stream);
+
+#endif
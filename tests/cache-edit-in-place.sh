@@ -0,0 +1,47 @@
+#!/bin/sh
+# A file edited in place with its modification time put back must not
+# get its old hashes from the cache, while a file that was only renamed
+# should keep them.
+
+FDUPES=${FDUPES:-./fdupes}
+
+dir=`mktemp -d` || exit 99
+trap 'rm -rf "$dir"' EXIT
+
+# skip when built without --cache support
+"$FDUPES" --help | grep -q -e '--cache' || exit 77
+
+XDG_CACHE_HOME="$dir/cache"
+export XDG_CACHE_HOME
+mkdir "$XDG_CACHE_HOME"
+
+mkdir "$dir/files"
+head -c 10000 /dev/zero > "$dir/files/a"
+head -c 10000 /dev/zero > "$dir/files/b"
+touch -d '2020-01-01 00:00:00' "$dir/files/a" "$dir/files/b"
+
+"$FDUPES" -c -r "$dir/files" > "$dir/before" || exit 99
+test -s "$dir/before" || { echo "identical files not reported"; exit 1; }
+
+# change the last byte of a without changing its size or mtime
+printf 'x' | dd of="$dir/files/a" bs=1 seek=9999 conv=notrunc 2>/dev/null
+touch -d '2020-01-01 00:00:00' "$dir/files/a"
+
+# -M trusts signatures without comparing the files byte by byte
+"$FDUPES" -c -r -M "$dir/files" > "$dir/after" 2>&1 || exit 99
+if ! grep -q 'No duplicates found' "$dir/after"; then
+  echo "file edited in place reported as a duplicate:"
+  cat "$dir/after"
+  exit 1
+fi
+
+# a renamed file is found by its old row and not hashed again
+mv "$dir/files/b" "$dir/files/c"
+"$FDUPES" -c -r --stats "$dir/files" 2> "$dir/stats" > /dev/null || exit 99
+if ! grep -q '^files opened (hashing): *0$' "$dir/stats"; then
+  echo "renamed file hashed again:"
+  cat "$dir/stats"
+  exit 1
+fi
+
+exit 0
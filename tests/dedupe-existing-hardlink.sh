@@ -0,0 +1,30 @@
+#!/bin/sh
+# --dedupe must report a duplicate that is already a hard link to the
+# file kept as sharing its storage, rather than handing it to the kernel,
+# which rejects deduplicating a file against itself.
+
+FDUPES=${FDUPES:-./fdupes}
+
+dir=`mktemp -d` || exit 99
+trap 'rm -rf "$dir"' EXIT
+
+mkdir "$dir/files"
+head -c 10000 /dev/zero > "$dir/files/a"
+ln "$dir/files/a" "$dir/files/b"
+
+"$FDUPES" -r -H --dedupe "$dir/files" > "$dir/output" 2>&1
+status=$?
+
+if grep -q 'not supported in this fdupes build' "$dir/output"; then
+  exit 77
+fi
+
+[ $status -eq 0 ] || exit 99
+
+if grep -q '\[!\]' "$dir/output" || ! grep -q '\[=\]' "$dir/output"; then
+  echo "hard link not reported as shared:"
+  cat "$dir/output"
+  exit 1
+fi
+
+exit 0
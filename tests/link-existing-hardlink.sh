@@ -0,0 +1,37 @@
+#!/bin/sh
+# --link must leave a duplicate that is already a hard link to the file
+# kept as it is, without leaving its temporary link behind.
+
+FDUPES=${FDUPES:-./fdupes}
+
+dir=`mktemp -d` || exit 99
+trap 'rm -rf "$dir"' EXIT
+
+mkdir "$dir/files"
+head -c 10000 /dev/zero > "$dir/files/a"
+ln "$dir/files/a" "$dir/files/b"
+cp "$dir/files/a" "$dir/files/c"
+
+"$FDUPES" -r -H --link "$dir/files" > "$dir/output" 2>&1 || exit 99
+
+if grep -q '\[!\]' "$dir/output"; then
+  echo "duplicate not linked:"
+  cat "$dir/output"
+  exit 1
+fi
+
+leftover=`ls "$dir/files" | grep -v -x -e a -e b -e c`
+if [ -n "$leftover" ]; then
+  echo "temporary links left behind: $leftover"
+  exit 1
+fi
+
+# all three names now link to one file
+inodes=`ls -i "$dir/files" | awk '{ print $1 }' | sort -u | wc -l`
+if [ "$inodes" -ne 1 ]; then
+  echo "files not linked together:"
+  ls -li "$dir/files"
+  exit 1
+fi
+
+exit 0
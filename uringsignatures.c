@@ -0,0 +1,499 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "uringsignatures.h"
+#include "sigint.h"
+#include "stats.h"
+#include "devicequeue.h"
+
+#define URING_BUFFER_SIZE (CHUNK_SIZE * 8)
+
+#define SLOT_FREE 0
+#define SLOT_OPENING 1
+#define SLOT_READING 2
+
+struct uring
+{
+  int fd;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned int unsubmitted;
+};
+
+struct uringslot
+{
+  int state;
+  size_t file;
+  int fd;
+  off_t offset;
+  off_t remaining;
+  unsigned long long bytesread;
+  struct hashstate hash;
+  md5_byte_t digest[HASH_DIGEST_LENGTH];
+  md5_byte_t *buffer;
+};
+
+/* whether the kernel supports every operation used here; kernels older
+   than 5.6 know neither IORING_REGISTER_PROBE nor IORING_OP_OPENAT */
+static int uring__probe(int fd)
+{
+  struct io_uring_probe *probe;
+  size_t size;
+  int result;
+
+  size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+  probe = (struct io_uring_probe*) malloc(size);
+  if (probe == 0)
+    return 0;
+
+  memset(probe, 0, size);
+
+  result = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+    probe->last_op >= IORING_OP_OPENAT && probe->last_op >= IORING_OP_READ &&
+    (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+
+  free(probe);
+
+  return result;
+}
+
+static int uring__setup(struct uring *ring, unsigned int entries)
+{
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return 0;
+
+  if (!uring__probe(ring->fd)) {
+    close(ring->fd);
+    return 0;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(ring->fd);
+    return 0;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      return 0;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_ring != ring->sq_ring)
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return 0;
+  }
+
+  ring->sq_head = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int*) ((char*) ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned int*) ((char*) ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned int*) ((char*) ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned int*) ((char*) ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) ((char*) ring->cq_ring + params.cq_off.cqes);
+
+  ring->unsubmitted = 0;
+
+  return 1;
+}
+
+static void uring__teardown(struct uring *ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+static struct io_uring_sqe *uring__getsqe(struct uring *ring, unsigned long long userdata)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int tail;
+  unsigned int index;
+
+  tail = *ring->sq_tail;
+  index = tail & *ring->sq_mask;
+
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = userdata;
+
+  ring->sq_array[index] = index;
+
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  ++ring->unsubmitted;
+
+  return sqe;
+}
+
+static void uring__prepareopen(struct uring *ring, size_t slot, const char *path)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring__getsqe(ring, slot);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (unsigned long) path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void uring__prepareread(struct uring *ring, size_t slot, int fd, void *buffer, unsigned int length, off_t offset)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring__getsqe(ring, slot);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) buffer;
+  sqe->len = length;
+  sqe->off = offset;
+}
+
+/* submit pending requests and wait for at least one completion */
+static int uring__submitandwait(struct uring *ring)
+{
+  int result;
+
+  result = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS, 0, 0);
+  if (result < 0)
+    return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+
+  ring->unsubmitted -= result;
+
+  return 1;
+}
+
+static void uring__readnext(struct uring *ring, struct uringslot *slots, size_t s)
+{
+  off_t toread;
+
+  toread = slots[s].remaining < URING_BUFFER_SIZE ? slots[s].remaining : URING_BUFFER_SIZE;
+
+  slots[s].state = SLOT_READING;
+  uring__prepareread(ring, s, slots[s].fd, slots[s].buffer, toread, slots[s].offset);
+}
+
+static void uring__release(struct uringslot *slot, struct devicequeue *devices)
+{
+  if (slot->state == SLOT_READING) {
+    hash_finish(&slot->hash, slot->digest);
+    close(slot->fd);
+  }
+
+  stats_add(&stats.bytesread, slot->bytesread);
+
+  if (devices != 0)
+    devicequeue_release(devices, slot->file);
+
+  slot->state = SLOT_FREE;
+}
+
+/* Compute the digest of the first max_read bytes (or the whole file,
+   if max_read is 0) of each file, keeping up to IO_URING_DEPTH files
+   open and being read at once, and hashing each block as soon as its
+   read completes. The digest of files[f] is stored where digests[f]
+   points, or digests[f] is set to 0 if the file could not be read.
+   If perdevice is not 0, at most perdevice files on any one device are
+   open at a time, with the remaining slots going to other devices.
+
+   Returns 0, without touching any file, if io_uring (or one of the
+   operations used) is not available on this system. Also returns 0 if
+   the kernel stops accepting requests part way through. digests[] then
+   holds the pointers it was passed, some of the digests they point to
+   may have been written, and the caller should hash every file some
+   other way. Files still being read are closed, but the buffers of
+   requests still in flight are left allocated, and a file whose open
+   was still in flight is left open. */
+int uringsignatures(file_t **files, size_t count, off_t max_read, size_t perdevice, md5_byte_t **digests, void (*progress)(size_t done, size_t total))
+{
+  struct devicequeue devices;
+  struct devicequeue *queue;
+  md5_byte_t **targets;
+  unsigned long long *keys;
+  struct uring ring;
+  struct uringslot *slots;
+  struct io_uring_cqe *cqe;
+  struct uringslot *slot;
+  unsigned int head;
+  size_t depth;
+  size_t next;
+  size_t done;
+  size_t busy;
+  size_t file;
+  size_t s;
+  off_t size;
+  int result;
+  int failed = 0;
+
+  depth = IO_URING_DEPTH;
+
+  targets = (md5_byte_t**) malloc(sizeof(md5_byte_t*) * count);
+  slots = (struct uringslot*) malloc(sizeof(struct uringslot) * depth);
+  if (targets == 0 || slots == 0) {
+    free(targets);
+    free(slots);
+    return 0;
+  }
+
+  for (s = 0; s < depth; ++s) {
+    slots[s].state = SLOT_FREE;
+    slots[s].buffer = (md5_byte_t*) malloc(URING_BUFFER_SIZE);
+    if (slots[s].buffer == 0) {
+      while (s-- > 0)
+        free(slots[s].buffer);
+      free(slots);
+      free(targets);
+      return 0;
+    }
+  }
+
+  if (!uring__setup(&ring, depth)) {
+    for (s = 0; s < depth; ++s)
+      free(slots[s].buffer);
+    free(slots);
+    free(targets);
+    return 0;
+  }
+
+  /* digests are only pointed back at their targets once read */
+  for (next = 0; next < count; ++next) {
+    targets[next] = digests[next];
+    digests[next] = 0;
+  }
+
+  queue = 0;
+  if (perdevice > 0) {
+    keys = (unsigned long long*) malloc(sizeof(unsigned long long) * count);
+    if (keys != 0) {
+      for (next = 0; next < count; ++next)
+        keys[next] = files[next]->device;
+
+      if (devicequeue_init(&devices, keys, count, perdevice))
+        queue = &devices;
+
+      free(keys);
+    }
+  }
+
+  next = 0;
+  done = 0;
+  busy = 0;
+
+  for (;;) {
+    /* start opening files in every free slot */
+    for (s = 0; s < depth && next < count && !got_sigint; ++s) {
+      if (slots[s].state != SLOT_FREE)
+        continue;
+
+      if (queue == 0)
+        file = next;
+      else if (!devicequeue_take(queue, &file))
+        break;
+
+      ++next;
+
+      slots[s].state = SLOT_OPENING;
+      slots[s].file = file;
+      slots[s].bytesread = 0;
+
+      uring__prepareopen(&ring, s, files[slots[s].file]->d_name);
+
+      ++busy;
+    }
+
+    if (busy == 0)
+      break;
+
+    if (!uring__submitandwait(&ring)) {
+      failed = 1;
+      break;
+    }
+
+    head = *ring.cq_head;
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      slot = &slots[cqe->user_data];
+      result = cqe->res;
+
+      ++head;
+
+      if (slot->state == SLOT_OPENING) {
+        if (result < 0) {
+          uring__release(slot, queue);
+          --busy;
+          ++done;
+          continue;
+        }
+
+        stats_add(&stats.opens, 1);
+
+        size = files[slot->file]->size;
+        if (max_read != 0 && size > max_read)
+          size = max_read;
+
+        slot->fd = result;
+        slot->offset = 0;
+        slot->remaining = size;
+        slot->state = SLOT_READING;
+
+        hash_init(&slot->hash);
+      } else {
+        /* a read error, or a file shorter than expected */
+        if (result <= 0) {
+          uring__release(slot, queue);
+          --busy;
+          ++done;
+          continue;
+        }
+
+        hash_update(&slot->hash, slot->buffer, result);
+
+        slot->bytesread += result;
+        slot->offset += result;
+        slot->remaining -= result;
+      }
+
+      if (slot->remaining > 0 && !got_sigint) {
+        uring__readnext(&ring, slots, slot - slots);
+        continue;
+      }
+
+      uring__release(slot, queue);
+
+      if (slot->remaining == 0) {
+        digests[slot->file] = targets[slot->file];
+        memcpy(digests[slot->file], slot->digest, HASH_DIGEST_LENGTH);
+      }
+
+      --busy;
+      ++done;
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    if (progress != 0)
+      progress(done, count);
+  }
+
+  if (failed) {
+    /* requests that already completed are no longer in flight */
+    head = *ring.cq_head;
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      slot = &slots[cqe->user_data];
+
+      if (slot->state == SLOT_OPENING && cqe->res >= 0)
+        close(cqe->res);
+      else if (slot->state == SLOT_READING)
+        close(slot->fd);
+
+      slot->state = SLOT_FREE;
+
+      ++head;
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    for (next = 0; next < count; ++next)
+      digests[next] = targets[next];
+  }
+
+  uring__teardown(&ring);
+
+  if (queue != 0)
+    devicequeue_free(queue);
+
+  free(targets);
+
+  /* reads still in flight may yet write to their buffers, so leave those
+     allocated; the files they read from can be closed, since a read
+     keeps its own reference to its file */
+  if (failed) {
+    for (s = 0; s < depth; ++s) {
+      if (slots[s].state == SLOT_FREE)
+        free(slots[s].buffer);
+      else if (slots[s].state == SLOT_READING)
+        close(slots[s].fd);
+    }
+
+    free(slots);
+
+    return 0;
+  }
+
+  for (s = 0; s < depth; ++s)
+    free(slots[s].buffer);
+  free(slots);
+
+  return 1;
+}
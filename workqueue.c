@@ -0,0 +1,202 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include "workqueue.h"
+#include "devicequeue.h"
+#include "sigint.h"
+
+struct workqueue
+{
+  void **items;
+  size_t count;
+  size_t next;
+  size_t done;
+  int running;
+  int limited;
+  struct devicequeue devices;
+  workfunction_t work;
+  void *context;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  pthread_cond_t released;
+};
+
+/* Pick the next item to work on. Returns 0 once every item has been
+   handed out. */
+static int workqueue__take(struct workqueue *queue, size_t *item)
+{
+  if (!queue->limited)
+  {
+    if (queue->next == queue->count)
+      return 0;
+
+    *item = queue->next++;
+    return 1;
+  }
+
+  /* wait for a device to drop below its limit */
+  while (!devicequeue_take(&queue->devices, item))
+  {
+    if (queue->devices.remaining == 0 || got_sigint)
+      return 0;
+
+    pthread_cond_wait(&queue->released, &queue->mutex);
+  }
+
+  return 1;
+}
+
+static void *workqueue__worker(void *arg)
+{
+  struct workqueue *queue = arg;
+  size_t item;
+
+  pthread_mutex_lock(&queue->mutex);
+
+  while (!got_sigint && workqueue__take(queue, &item))
+  {
+    pthread_mutex_unlock(&queue->mutex);
+
+    queue->work(queue->items[item], queue->context);
+
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->limited)
+    {
+      devicequeue_release(&queue->devices, item);
+      pthread_cond_broadcast(&queue->released);
+    }
+
+    ++queue->done;
+  }
+
+  --queue->running;
+  pthread_cond_signal(&queue->changed);
+
+  pthread_mutex_unlock(&queue->mutex);
+
+  return 0;
+}
+
+/* Hand each item to work() on a pool of threads, in array order, and
+   wait until every item has been processed or SIGINT is received. The
+   calling thread only waits, reporting progress every
+   FDUPES_PROGRESS_REFRESH_MS milliseconds if progress is not 0.
+   If devices is not 0, devices[i] identifies the device item i lives
+   on, and at most perdevice items from any one device are worked on at
+   a time, with threads spread across devices. Returns the number of
+   items processed. */
+int workqueue_run(void **items, size_t count, int threads, const unsigned long long *devices, size_t perdevice, workfunction_t work, void *context, workprogress_t progress)
+{
+  struct workqueue queue;
+  struct timespec deadline;
+  pthread_t *workers;
+  size_t done;
+  int started;
+  int t;
+
+  if (count == 0)
+    return 0;
+
+  if ((size_t) threads > count)
+    threads = count;
+
+  workers = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+  if (workers == 0)
+    threads = 0;
+
+  queue.items = items;
+  queue.count = count;
+  queue.next = 0;
+  queue.done = 0;
+  queue.running = 0;
+  queue.limited = 0;
+  queue.work = work;
+  queue.context = context;
+
+  if (devices != 0 && perdevice > 0)
+    queue.limited = devicequeue_init(&queue.devices, devices, count, perdevice);
+
+  pthread_mutex_init(&queue.mutex, 0);
+  pthread_cond_init(&queue.changed, 0);
+  pthread_cond_init(&queue.released, 0);
+
+  pthread_mutex_lock(&queue.mutex);
+
+  started = 0;
+  for (t = 0; t < threads; ++t)
+  {
+    if (pthread_create(&workers[started], 0, workqueue__worker, &queue) != 0)
+      break;
+
+    ++started;
+    ++queue.running;
+  }
+
+  pthread_mutex_unlock(&queue.mutex);
+
+  /* no threads could be started; do the work here instead */
+  if (started == 0)
+  {
+    ++queue.running;
+    workqueue__worker(&queue);
+  }
+
+  pthread_mutex_lock(&queue.mutex);
+
+  while (queue.running > 0)
+  {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += FDUPES_PROGRESS_REFRESH_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    if (pthread_cond_timedwait(&queue.changed, &queue.mutex, &deadline) == ETIMEDOUT && progress != 0)
+    {
+      done = queue.done;
+
+      pthread_mutex_unlock(&queue.mutex);
+      progress(done, queue.count);
+      pthread_mutex_lock(&queue.mutex);
+    }
+  }
+
+  pthread_mutex_unlock(&queue.mutex);
+
+  for (t = 0; t < started; ++t)
+    pthread_join(workers[t], 0);
+
+  free(workers);
+
+  if (queue.limited)
+    devicequeue_free(&queue.devices);
+
+  pthread_cond_destroy(&queue.released);
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.mutex);
+
+  return queue.done;
+}